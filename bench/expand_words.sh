@@ -0,0 +1,40 @@
+#!/bin/sh
+# Measures word expansion on long words. Each of COUNT lines is 'cd . WORD', with WORD WORD_KB
+# kilobytes of PATTERN repeated (default 'abcdefgh$$', one $$ every ten bytes), which cd ignores
+# after the shell has expanded it. Best of RUNS runs. A second shell, such as a build from before
+# the one-pass expansion, is measured the same way for comparison. Only $$ is understood by older
+# builds, so set PATTERN to something like 'a${HOME}b$?' for the current one alone.
+#
+#     bench/expand_words.sh ./smallsh [./smallsh-old]
+
+count=${COUNT:-2000}
+word_kb=${WORD_KB:-8}
+runs=${RUNS:-3}
+pattern=${PATTERN:-'abcdefgh$$'}
+
+directory=$(mktemp -d)
+trap 'rm -rf "$directory"' EXIT
+# Every line differs, so none of them is answered from the command cache
+awk -v count="$count" -v size=$((word_kb * 1024)) -v pattern="$pattern" 'BEGIN {
+    word = pattern
+    while (length(word) < size) word = word word
+    word = substr(word, 1, size)
+    for (i = 0; i < count; i++) printf "cd . %s%d\n", word, i
+    print "exit"
+}' > "$directory/input"
+
+for shell in "${1:-./smallsh}" ${2:+"$2"}; do
+    best=
+    run=0
+    while [ $run -lt "$runs" ]; do
+        start=$(date +%s%N)
+        "$shell" < "$directory/input" > /dev/null
+        end=$(date +%s%N)
+        if [ -z "$best" ] || [ $((end - start)) -lt "$best" ]; then
+            best=$((end - start))
+        fi
+        run=$((run + 1))
+    done
+    awk -v shell="$shell" -v count="$count" -v bytes="$(wc -c < "$directory/input")" -v ns="$best" \
+        'BEGIN { printf "%-20s %d words: %.3fs, %.0f MB/s\n", shell, count, ns / 1e9, bytes * 1e3 / ns }'
+done
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Measures the throughput in MB/s of a three-stage pipeline run by smallsh, 'cat FILE | cat | cat',
+# over a file of SIZE_MB megabytes, once for each pipe capacity in PIPE_SIZES given to 'pipesize'
+# (0 keeps the kernel default). Capacities above /proc/sys/fs/pipe-max-size need root.
+#
+#     bench/pipeline_throughput.sh ./smallsh
+
+shell=${1:-./smallsh}
+size_mb=${SIZE_MB:-1024}
+pipe_sizes=${PIPE_SIZES:-"0 262144 1048576"}
+
+data=$(mktemp)
+input=$(mktemp)
+trap 'rm -f "$data" "$input"' EXIT
+head -c $((size_mb * 1024 * 1024)) /dev/zero > "$data"
+
+for pipe_size in $pipe_sizes; do
+    printf 'pipesize %s\ncat %s | cat | cat > /dev/null\nexit\n' "$pipe_size" "$data" > "$input"
+    start=$(date +%s%N)
+    "$shell" < "$input" > /dev/null
+    end=$(date +%s%N)
+    awk -v pipe_size="$pipe_size" -v size="$size_mb" -v ns=$((end - start)) \
+        'BEGIN { printf "pipesize %s: %d MB in %.2fs, %.0f MB/s\n", pipe_size, size, ns / 1e9, size * 1e9 / ns }'
+done
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Regression test for memory that grows with the number of commands run. smallsh runs COUNT
+# command lines (a million by default) that never repeat, with quotes and expansions, and reads its
+# own VmRSS after a warm-up and again at the end. Fails if it grew by more than LIMIT_KB.
+#
+#     bench/rss_flat.sh ./smallsh
+
+shell=${1:-./smallsh}
+count=${COUNT:-1000000}
+warmup=${WARMUP:-10000}
+limit_kb=${LIMIT_KB:-256}
+
+input=$(mktemp)
+trap 'rm -f "$input"' EXIT
+# cd only uses its first argument, so the lines keep the shell where it is without a child each
+awk -v count="$count" -v warmup="$warmup" 'BEGIN {
+    for (i = 0; i < count; i++) {
+        if (i == warmup) {
+            print "grep VmRSS /proc/$$/status"
+        }
+        printf "cd . word%d \"quoted $$ %d\" ${PWD}/%d $? '\''single %d'\'' x\\ %d\n", i, i, i, i, i
+    }
+    print "grep VmRSS /proc/$$/status"
+    print "exit"
+}' > "$input"
+
+"$shell" < "$input" | awk -v count="$count" -v limit="$limit_kb" '
+    # Older shells print their prompt even when stdin is not a terminal, so it can come first
+    {
+        for (i = 1; i < NF; i++) {
+            if ($i == "VmRSS:") {
+                rss[n++] = $(i + 1)
+            }
+        }
+    }
+    END {
+        if (n != 2) {
+            print "FAIL: expected two VmRSS readings, got " n + 0
+            exit 1
+        }
+        printf "VmRSS after warm-up %d kB, after %d commands %d kB\n", rss[0], count, rss[1]
+        if (rss[1] - rss[0] > limit) {
+            printf "FAIL: grew by %d kB, more than %d kB\n", rss[1] - rss[0], limit
+            exit 1
+        }
+        print "PASS"
+    }'
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Measures how fast smallsh scans long words. The input is SIZE_MB megabytes of lines
+# 'cd . WORD', each WORD LINE_KB kilobytes of base64, which the lexer reads in one run of plain
+# bytes and cd ignores. The same number of lines with a one-byte WORD is timed as well, and the
+# throughput is the extra bytes over the extra time, so the per-line cost of running the command
+# is left out, while reading, scanning and copying the words is counted. Best of RUNS runs each. A second shell, such as a build from before the
+# vector scanner, is measured the same way for comparison.
+#
+#     bench/scan_throughput.sh ./smallsh [./smallsh-scalar]
+
+size_mb=${SIZE_MB:-256}
+line_kb=${LINE_KB:-64}
+runs=${RUNS:-3}
+lines=$((size_mb * 1024 / line_kb))
+
+directory=$(mktemp -d)
+trap 'rm -rf "$directory"' EXIT
+# Every line differs, so none of them is answered from the command cache
+head -c $((size_mb * 1024 * 1024 * 3 / 4)) /dev/urandom | base64 -w $((line_kb * 1024)) |
+    sed 's/^/cd . /' > "$directory/long"
+echo exit >> "$directory/long"
+awk -v lines="$lines" 'BEGIN { for (i = 0; i < lines; i++) printf "cd . %d\n", i; print "exit" }' > "$directory/short"
+
+# Prints the best time of RUNS runs of the shell $1 over the input file $2, in nanoseconds
+best_time() {
+    best=
+    run=0
+    while [ $run -lt "$runs" ]; do
+        start=$(date +%s%N)
+        "$1" < "$2" > /dev/null
+        end=$(date +%s%N)
+        if [ -z "$best" ] || [ $((end - start)) -lt "$best" ]; then
+            best=$((end - start))
+        fi
+        run=$((run + 1))
+    done
+    echo "$best"
+}
+
+for shell in "${1:-./smallsh}" ${2:+"$2"}; do
+    long=$(best_time "$shell" "$directory/long")
+    short=$(best_time "$shell" "$directory/short")
+    awk -v shell="$shell" -v bytes="$(($(wc -c < "$directory/long") - $(wc -c < "$directory/short")))" \
+        -v long="$long" -v short="$short" -v lines="$lines" \
+        'BEGIN { printf "%-20s %d lines: %.3fs long, %.3fs short, scanner %.2f GB/s\n", shell, lines,
+                 long / 1e9, short / 1e9, (long > short ? bytes / (long - short) : 0) }'
+done
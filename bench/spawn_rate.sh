@@ -0,0 +1,25 @@
+#!/bin/sh
+# Measures how many external commands per second each smallsh given starts, by feeding it COUNT
+# lines of /bin/true followed by exit. To compare with the fork() launcher of the original shell:
+#
+#     git show 8cb7cf2:main.c > /tmp/fork.c && gcc --std=gnu99 -O2 -o /tmp/smallsh-fork /tmp/fork.c
+#     gcc --std=gnu99 -O2 -o smallsh main.c
+#     bench/spawn_rate.sh /tmp/smallsh-fork ./smallsh
+
+count=${COUNT:-20000}
+if [ $# -eq 0 ]; then
+    set -- ./smallsh
+fi
+
+input=$(mktemp)
+trap 'rm -f "$input"' EXIT
+yes /bin/true | head -n "$count" > "$input"
+echo exit >> "$input"
+
+for shell in "$@"; do
+    start=$(date +%s%N)
+    "$shell" < "$input" > /dev/null
+    end=$(date +%s%N)
+    awk -v shell="$shell" -v count="$count" -v ns=$((end - start)) \
+        'BEGIN { printf "%s: %d commands in %.2fs, %.0f commands/s\n", shell, count, ns / 1e9, count * 1e9 / ns }'
+done
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Compares the tee builtin of smallsh with an external tee program (TEE, /usr/bin/tee by default)
+# in the pipeline 'cat DATA | tee FILE | wc -c' over SIZE_MB megabytes, once with FILE /dev/null and
+# once with a file in a temporary directory (TMPDIR), best of RUNS runs each.
+#
+#     bench/tee_throughput.sh ./smallsh
+
+shell=${1:-./smallsh}
+size_mb=${SIZE_MB:-200}
+runs=${RUNS:-3}
+external=${TEE:-/usr/bin/tee}
+
+directory=$(mktemp -d)
+trap 'rm -rf "$directory"' EXIT
+head -c $((size_mb * 1024 * 1024)) /dev/urandom > "$directory/data"
+
+for tee in tee "$external"; do
+    for file in /dev/null "$directory/out"; do
+        printf 'cat %s | %s %s | wc -c > /dev/null\nexit\n' "$directory/data" "$tee" "$file" > "$directory/input"
+        best=
+        run=0
+        while [ $run -lt "$runs" ]; do
+            start=$(date +%s%N)
+            "$shell" < "$directory/input" > /dev/null
+            end=$(date +%s%N)
+            if [ -z "$best" ] || [ $((end - start)) -lt "$best" ]; then
+                best=$((end - start))
+            fi
+            run=$((run + 1))
+        done
+        awk -v tee="$tee" -v file="$file" -v size="$size_mb" -v ns="$best" \
+            'BEGIN { printf "%-14s -> %-20s %.3fs, %.0f MB/s\n", tee, file == "/dev/null" ? file : "file", ns / 1e9, size * 1e9 / ns }'
+    done
+done
@@ -1,280 +1,5042 @@
-/*
-   Author:       Aaron Nesbit
-
-   Description:  This program is an implementation of a shell called smallsh. It provides a prompt for running
-   				 commands, handles blank lines and comments, provides expansion for the variable $$, executes
-   				 the commands exit, cd and status, executes other commands by creating new process using exec
-   				 functions, supports input and output redirection, supports running commands in foreground
-   				 and background processes, and implements customs handlers for 2 signals, SIGINT and SIGSTP.
-*/
-
-#include <fcntl.h>
-#include <signal.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/wait.h>
-#include <unistd.h>
-
-// Flag for SIGTSTP initialized
-int foreground_mode_flag = 0;
-
-/*
-    Custom handler for SIGINT defined
-*/
-void handle_SIGINT(int signo) {
-    char* message = "Caught SIGINT\n";
-    write(STDOUT_FILENO, message, 15);
-}
-
-/*
-    Custom handler for SIGTSTP defined
-*/
-void handle_SIGTSTP(int signal) {
-    if (foreground_mode_flag == 0) {
-        // Foreground-only mode is entered and the user is notified
-        char* message = "\nEntering foreground-only mode (& is now ignored)\n";
-        write(STDOUT_FILENO, message, 51);
-        foreground_mode_flag = 1;
-    }
-    else {
-        // Foreground-only mode has been exited and the user is notified
-        char* message = "\nExiting foreground-only mode\n";
-        write(STDOUT_FILENO, message, 31);
-        foreground_mode_flag = 0;
-    }
-}
-
-/*
-    Function that replaces occurrences of $$ in a provided string
-*/
-char* replace_double_dollarsigns(char* str, int pid) {
-    char buffer[100], *replacement;
-    sprintf(buffer, "%d", pid);
-    int i;
-    int counter = 0;
-    int buffer_length = strlen(buffer);
-    for (i = 0; str[i] != '\0'; i++) {
-        if (strstr(&str[i], "$$") == &str[i]) {
-            i++;
-            counter++;
-        }
-    }
-    replacement = (char*)malloc(i + counter * (buffer_length - 2) + 1);
-    i = 0;
-    while (*str) {
-        if (strstr(str, "$$") == str) {
-            strcpy(&replacement[i], buffer);
-            i += buffer_length;
-            str += 2;
-        }
-        else {
-            replacement[i++] = *str++;
-        }
-    }
-    // Converted string is null-terminated
-    replacement[i] = '\0';
-    // String with $$'s is returned 
-    return replacement;
-}
-
-/*
-* This is main function that runs the shell
-*/
-int main(void)
-{
-    // Variables and structs are initialized
-    char user_input[2048];
-    char* command_line[2048];
-    char str[512];
-    int child_exit_status = -5;
-    int background_mode_flag = 0;
-    pid_t spawnPid = -5;
-    struct sigaction SIGINT_action = { {0} };
-    struct sigaction SIGTSTP_action = { {0} };
-
-    // Signal handler for SIGINT established
-    SIGINT_action.sa_handler = SIG_IGN;
-    SIGINT_action.sa_flags = 0;
-    sigfillset(&(SIGINT_action.sa_mask));
-    sigaction(SIGINT, &SIGINT_action, NULL);
-
-    // Signal handler for SIGTSTP established
-    SIGTSTP_action.sa_handler = handle_SIGTSTP;
-    SIGTSTP_action.sa_flags = 0;
-    sigfillset(&(SIGTSTP_action.sa_mask));
-    sigaction(SIGTSTP, &SIGTSTP_action, NULL);
-
-    // The shell then starts and runs until the 'exit' command is given and exit(0) is executed
-    while (1) {
-        // Variables are initialized
-        char input_file[100] = { 0 };
-        char output_file[100] = { 0 };
-        int index = 0;
-        
-        // The command prompt is displayed
-        printf(": ");
-        fflush(stdout);
-        strcpy(user_input, "\n");
-
-        // User's command is collected and stored for parsing
-        fgets(user_input, 2048, stdin);
-
-        // Parse the user-entered command
-        char* token = strtok(user_input, " ");
-        while (token != NULL) {
-            // Check for special symbol < for file input
-            if (strcmp(token, "<") == 0) {
-                token = strtok(NULL, " ");
-                sscanf(token, "%s", input_file);
-                token = strtok(NULL, " ");
-            }
-            // Check for special symbol > for file output
-            else if (strcmp(token, ">") == 0) {
-                token = strtok(NULL, " ");
-                sscanf(token, "%s", output_file);
-                token = strtok(NULL, " ");
-            }
-            // Check for $$ so it can be replaced
-            else if (strstr(token, "$$") != NULL) {
-                sscanf(token, "%s", str);
-                // $$ replacement function called
-                command_line[index++] = strdup(replace_double_dollarsigns(str, getpid()));
-                token = strtok(NULL, " ");
-            }
-            // Any other tokens go into the command_line array
-            else {
-                sscanf(token, "%s", str);
-                command_line[index++] = strdup(str);
-                token = strtok(NULL, " ");
-            }
-        }
-
-        // If user enters nothing, command_line is set to NULL
-        if (user_input[0] == '\n') {
-            command_line[0] = NULL;
-        }
-
-        // If user entered something and it's not a comment (#)
-        if ((command_line[0] != NULL) && (command_line[0][0] != '#')) {
-            // See if an & is present indicating a background process
-            if (strcmp(command_line[index - 1], "&") == 0) {
-                command_line[index - 1] = NULL;
-                background_mode_flag = 1;
-            }
-            else {
-                command_line[index++] = NULL;
-                background_mode_flag = 0;
-            }
-
-            // See if user has entered the 'exit' command
-            if (strcmp(command_line[0], "exit") == 0) {
-                exit(0);
-            }
-            // See if user has entered the 'cd' command
-            else if (strcmp(command_line[0], "cd") == 0) {
-                // If no directory specifed, go to home directory
-                if (index - 1 == 1) {
-                    chdir(getenv("HOME"));
-                }
-                // If a directory is specified, go there
-                else {
-                    chdir(command_line[1]);
-                }
-            }
-            // See if user has entered the 'status' command
-            else if (strcmp(command_line[0], "status") == 0) {
-                // If the process exited normally the exit status is displayed
-                if (WIFEXITED(child_exit_status)) {
-                    printf("exit value %i\n", WEXITSTATUS(child_exit_status));
-                }
-                // If the process was terminated by a signal, termination signal is displayed
-                else {
-                    printf("terminated by signal %i\n", child_exit_status);
-                }
-            }
-            // All other commands that require a child to be spawned are now handled
-            else {
-                spawnPid = fork();
-                switch (spawnPid) {
-                    case -1:
-                        // If the fork fails, an error is displayed
-                        perror("fork() failed!\n");
-                        _exit(1);
-                        break;
-                    case 0:
-                        // The fork is successful and the program continues
-                        if (background_mode_flag == 0) {
-                            SIGINT_action.sa_handler = SIG_DFL;
-                            sigaction(SIGINT, &SIGINT_action, NULL);
-                        }
-                        if (input_file[0] != 0) {
-                            int in = open(input_file, O_RDONLY);
-                            if (in == -1) {
-                                // If the target file does not exist an error message is displayed
-                                printf("%s: no such file or directory\n", input_file);
-                                fflush(stdout);
-                                _exit(1);
-                            }
-                            if (dup2(in, 0) == -1) {
-                                // If dup2 fails an error message is displayed
-                                perror("dup2");
-                                _exit(1);
-                            }
-                            close(in);
-                        }
-                        if (output_file[0] != 0) {
-                            int out = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0777);
-                            if (out == -1) {
-                                // if the file cannot be opened an error message is displayed
-                                printf("cannot open %s\n", output_file);
-                                fflush(stdout);
-                                _exit(1);
-                            }
-                            if (dup2(out, 1) == -1) {
-                                // If dup2 fails an error message is displayed
-                                perror("dup2");
-                                _exit(1);
-                            }
-                            close(out);
-                        }
-                        if (execvp(command_line[0], command_line) < 0) {
-                            // If an invalid command is entered an error message is displayed
-                            printf("%s is an invalid command\n", command_line[0]);
-                            fflush(stdout);
-                            _exit(1);
-                        }
-                        break;
-                    default:
-                        // If the process is a foreground process, wait for the process to finish
-                        if (foreground_mode_flag == 1 || background_mode_flag == 0) {
-                            waitpid(spawnPid, &child_exit_status, 0);
-                        }
-                        // If the process is a background process, proceed to run in the background
-                        else if(background_mode_flag == 1){
-                            printf("background pid is %d\n", spawnPid);
-                            fflush(stdout);
-                        }
-                }
-            }
-            spawnPid = waitpid(-1, &child_exit_status, WNOHANG);
-            while (spawnPid > 0) {
-                printf("background pid %i is done: ", spawnPid);
-                fflush(stdout);
-                if (WIFEXITED(child_exit_status)) {
-                    printf("exit value %i\n", WEXITSTATUS(child_exit_status));
-                    fflush(stdout);
-                }
-                else {
-                    printf("terminated by signal %i\n", child_exit_status);
-                    fflush(stdout);
-                }
-                spawnPid = waitpid(-1, &child_exit_status, WNOHANG);
-            }
-        }
-    }
-    // The program ends
-	return 0;
-}
\ No newline at end of file
+/*
+   Author:       Aaron Nesbit
+
+   Description:  This program is an implementation of a shell called smallsh. It provides a prompt for running
+   				 commands, handles blank lines and comments, provides expansion for the variable $$, executes
+   				 the commands exit, cd and status, executes other commands by creating new process using exec
+   				 functions, supports input and output redirection, supports running commands in foreground
+   				 and background processes, and implements customs handlers for 2 signals, SIGINT and SIGSTP.
+*/
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Flag for SIGTSTP initialized
+int foreground_mode_flag = 0;
+
+// Wait status of the last foreground command
+int child_exit_status = -5;
+
+// Bump allocator for everything that only lives as long as one command line. Its blocks are kept
+// and reused after arena_reset, so memory stays bounded by the largest line
+#define ARENA_BLOCK_SIZE 8192
+struct arena_block {
+    struct arena_block* next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+struct arena_block* arena_first = NULL;
+struct arena_block* arena_current = NULL;
+
+// A position in the arena that can be returned to with arena_release
+struct arena_mark {
+    struct arena_block* block;
+    size_t used;
+};
+
+// Byte the lexer puts in place of an unquoted $, so expansion can tell it from a quoted one
+#define EXPANSION_MARK '\001'
+
+// Byte the lexer puts where a quote or backslash was removed from a word with marks, so a quote
+// still ends a variable name as in "$HOME"dir. Expansion drops it again
+#define EXPANSION_BOUNDARY '\002'
+
+// Byte the lexer puts at the start of a '<(command)' or '>(command)' word, followed by the < or >
+// and the command's text. Expansion starts the command and replaces the word with /dev/fd/N
+#define PROCESS_MARK '\003'
+
+// The shell's ends of the pipes to process substitutions. They are close-on-exec until the
+// command they were made for starts, and are closed once it has. Nested commands, such as the
+// lines of a function or the command of a process substitution, add theirs after those of the
+// command around them and close them first
+int* substitution_fds = NULL;
+int substitution_count = 0;
+
+// The shell's pid as text for $$, formatted once at startup, and the pid of the last background
+// job for $!, empty until one has been started
+char pid_string[16];
+size_t pid_length = 0;
+char last_background_pid[16] = "";
+
+// Positional arguments for $0, $1, $2 and so on, and their number without $0 for $#. Functions
+// get their own while they run
+char* default_arguments[] = { "smallsh", NULL };
+char** arguments = default_arguments;
+int argument_count = 0;
+
+// Character classes of the lexer
+#define CHAR_WORD 0
+#define CHAR_BLANK 1
+#define CHAR_END 2
+#define CHAR_REDIRECT 3
+#define CHAR_PIPE 4
+#define CHAR_SINGLE_QUOTE 5
+#define CHAR_DOUBLE_QUOTE 6
+#define CHAR_BACKSLASH 7
+#define CHAR_DOLLAR 8
+unsigned char char_classes[256] = {
+    ['\0'] = CHAR_END, ['\n'] = CHAR_END, [' '] = CHAR_BLANK, ['\t'] = CHAR_BLANK,
+    ['<'] = CHAR_REDIRECT, ['>'] = CHAR_REDIRECT, ['|'] = CHAR_PIPE,
+    ['\''] = CHAR_SINGLE_QUOTE, ['"'] = CHAR_DOUBLE_QUOTE, ['\\'] = CHAR_BACKSLASH, ['$'] = CHAR_DOLLAR
+};
+
+// Bytes the scanner stops at: every byte up to and including ' ', which covers the blanks, the line
+// end, EXPANSION_MARK and EXPANSION_BOUNDARY, and every other byte that is not CHAR_WORD. Filled in
+// by init_scanner
+unsigned char scan_stops[256];
+
+// Finds the first byte of a null-terminated string that is in scan_stops. Points to the fastest
+// version the CPU supports once init_scanner has run
+char* scan_special_scalar(char* text);
+char* (*scan_special)(char*) = scan_special_scalar;
+
+// Environment handed to spawned commands
+extern char** environ;
+
+// Hash table of resolved command paths, keyed by command name
+#define HASH_TABLE_SIZE 64
+struct hash_entry {
+    char* name;
+    char* path;
+    int dir_index;
+    int hits;
+    struct hash_entry* next;
+};
+struct hash_entry* hash_table[HASH_TABLE_SIZE];
+
+// PATH value the hash table was built from, with its directories and their modification times
+char* hashed_path = NULL;
+char** hashed_path_dirs = NULL;
+struct timespec* hashed_path_mtimes = NULL;
+int hashed_path_dir_count = 0;
+
+// Capacity in bytes requested for pipeline pipes with F_SETPIPE_SZ, 0 for the kernel default
+int pipe_size = 0;
+
+// Directory fd of the shell's working directory, reopened by 'cd'. Redirection targets are opened
+// relative to it with openat()
+int cwd_fd = AT_FDCWD;
+
+// The fds the shell keeps open for itself are moved to this number or above, so that the fds 0 to 9
+// users can name in redirections never reach them
+#define SHELL_FD_MIN 10
+
+// Kinds of redirection. The first four open target on fd: '<', '>', '>>' and '<>'. REDIRECT_DUP
+// makes fd a copy of source ('N>&M' or 'N<&M') and REDIRECT_CLOSE closes it ('N>&-'). The last
+// two make fd read target itself: the body of a '<<DELIM' here-document, which the lexer leaves
+// as the delimiter with source set if it was quoted, or the word of a '<<<' here-string and a
+// newline
+#define REDIRECT_INPUT 0
+#define REDIRECT_OUTPUT 1
+#define REDIRECT_APPEND 2
+#define REDIRECT_READ_WRITE 3
+#define REDIRECT_DUP 4
+#define REDIRECT_CLOSE 5
+#define REDIRECT_HERE_DOC 6
+#define REDIRECT_HERE_STRING 7
+
+// The cat and cp builtins copy at most COPY_CHUNK bytes per system call, checking for SIGINT in
+// between, and use a buffer of COPY_BUFFER_SIZE bytes when the data has to pass through the shell.
+// The ways of copying are tried from the first that fits the two fds downwards
+#define COPY_CHUNK (8 * 1024 * 1024)
+#define COPY_BUFFER_SIZE (128 * 1024)
+#define COPY_FILE_RANGE 0
+#define COPY_SENDFILE 1
+#define COPY_SPLICE 2
+#define COPY_READ_WRITE 3
+
+// Here-documents and here-strings up to this size go through a pipe, which is filled before the
+// command starts and so must not block. Larger ones go into a sealed memfd
+#define HERE_DOC_PIPE_MAX 4096
+struct redirection {
+    int type;
+    int fd;
+    int source;
+    char* target;
+};
+
+// Flags the target of each kind of redirection is opened with
+int redirect_flags[] = {
+    [REDIRECT_INPUT] = O_RDONLY, [REDIRECT_OUTPUT] = O_WRONLY | O_CREAT | O_TRUNC,
+    [REDIRECT_APPEND] = O_WRONLY | O_CREAT | O_APPEND, [REDIRECT_READ_WRITE] = O_RDWR | O_CREAT
+};
+
+// One command of a pipeline with its arguments and its redirections, applied in order after the
+// pipes to the neighbouring stages
+struct stage {
+    char** argv;
+    struct redirection* redirections;
+    int redirection_count;
+};
+
+// A parsed command line: the words of all its stages, with a NULL after each stage, the stages,
+// the redirections of all stages in order and the words the lexer left for expansion. These are
+// slots: a word index, or -1 - index for the target of a redirection. The arrays start out in the
+// inline storage so a short line needs no memory at all, and move to larger copies in the arena
+// when a long line outgrows them
+#define INLINE_WORDS 64
+#define INLINE_STAGES 8
+#define INLINE_REDIRECTIONS 8
+#define INLINE_EXPANSIONS 16
+struct command {
+    char** words;
+    int word_count;
+    int word_capacity;
+    struct stage* stages;
+    int stage_count;
+    int stage_capacity;
+    struct redirection* redirections;
+    int redirection_count;
+    int redirection_capacity;
+    int* expansions;
+    int expansion_count;
+    int expansion_capacity;
+    int substitution_first;
+    int background_mode_flag;
+    char* text;
+    size_t text_length;
+    char* inline_words[INLINE_WORDS];
+    struct stage inline_stages[INLINE_STAGES];
+    struct redirection inline_redirections[INLINE_REDIRECTIONS];
+    int inline_expansions[INLINE_EXPANSIONS];
+};
+
+// A lexed command kept for running again, so it only has its expansions redone. It is one malloc'd
+// block holding the lexed text and the offsets into the text of the words (-1 for the NULL ending a
+// stage) and of the redirection targets (-1 for none). Entries of the command cache also keep the
+// raw line, which is NULL in the commands of compiled scripts. Cache entries are found by a hash of
+// the raw line and replaced when another line hashes to the same bucket. Lines longer than
+// COMMAND_CACHE_MAX_LINE are not cached
+#define COMMAND_CACHE_SIZE 32
+#define COMMAND_CACHE_MAX_LINE 4096
+struct cached_stage {
+    int argv;
+    int redirection_count;
+};
+struct cached_redirection {
+    int type;
+    int fd;
+    int source;
+    int target;
+};
+struct cached_command {
+    unsigned int hash;
+    size_t line_length;
+    char* line;
+    size_t text_length;
+    char* text;
+    int* words;
+    int word_count;
+    struct cached_stage* stages;
+    int stage_count;
+    struct cached_redirection* redirections;
+    int redirection_count;
+    int* expansions;
+    int expansion_count;
+    int background_mode_flag;
+};
+struct cached_command* command_cache[COMMAND_CACHE_SIZE];
+
+// Buffer holding the last line read from the input, grown to fit the longest line
+char* input_line = NULL;
+size_t input_size = 0;
+
+// Ways the command reader gets lines from stdin. Terminals and regular files are read in large
+// blocks: a terminal never returns more than one line per read, and the offset of a file can be
+// moved back to the first unused byte before a child shares stdin. Pipes are read ahead with
+// tee(2), which copies their data into peek_pipe without consuming it, and the bytes of the lines
+// used are only taken out of the pipe, by splicing them to null_fd, when a child is started or more
+// data is needed. Anything else is read a byte at a time. The buffer holds the bytes from
+// input_start to input_end, of which the last input_peeked are still in the pipe
+#define INPUT_BLOCK 0
+#define INPUT_PEEK 1
+#define INPUT_BYTE 2
+#define INPUT_BUFFER_SIZE 65536
+int input_mode = INPUT_BLOCK;
+char* input_buffer = NULL;
+size_t input_capacity = 0;
+size_t input_start = 0;
+size_t input_end = 0;
+size_t input_peeked = 0;
+int peek_pipe[2] = { -1, -1 };
+int null_fd = -1;
+
+// Whether prompts are shown, which is only when commands are read from a terminal
+int interactive = 1;
+
+// Script given as a file or with -c: the next line to run and the end of the text, or NULL when
+// commands come from stdin. script_terminated tells whether a '\0' can be read at script_end
+char* script_next = NULL;
+char* script_end = NULL;
+int script_terminated = 0;
+
+// Words that mean something to the script parser at the start of a line. KEYWORD_FUNCTION stands
+// for a NAME() word, which starts a function definition
+#define KEYWORD_NONE 0
+#define KEYWORD_IF 1
+#define KEYWORD_THEN 2
+#define KEYWORD_ELIF 3
+#define KEYWORD_ELSE 4
+#define KEYWORD_FI 5
+#define KEYWORD_WHILE 6
+#define KEYWORD_FOR 7
+#define KEYWORD_DO 8
+#define KEYWORD_DONE 9
+#define KEYWORD_OPEN_BRACE 10
+#define KEYWORD_CLOSE_BRACE 11
+#define KEYWORD_BREAK 12
+#define KEYWORD_CONTINUE 13
+#define KEYWORD_RETURN 14
+#define KEYWORD_FUNCTION 15
+char* script_keywords[] = {
+    NULL, "if", "then", "elif", "else", "fi", "while", "for", "do", "done", "{", "}", "break", "continue", "return"
+};
+
+// Commands execute_command runs in the shell itself rather than as programs, besides functions
+char* shell_builtins[] = {
+    "exit", "cd", "status", "hash", "pipesize", "parallel", "cgroup", "placement", "time", NULL
+};
+
+// Types of syntax tree nodes
+#define NODE_COMMAND 0
+#define NODE_IF 1
+#define NODE_WHILE 2
+#define NODE_FOR 3
+#define NODE_FUNCTION 4
+#define NODE_BREAK 5
+#define NODE_CONTINUE 6
+#define NODE_RETURN 7
+
+// A node of the syntax tree of a compound command. command is the command to run, the condition of
+// an if or while, the word list of a for or the line of a return. name is the variable of a for or
+// the name of a function. body is the then branch or the body of a loop or function, alternative
+// the else branch, which is a nested if for elif, and next the node that follows in a list. The
+// nodes live in the arena, while their commands are malloc'd and handed to the compiled program
+struct node {
+    int type;
+    struct cached_command* command;
+    char* name;
+    struct node* body;
+    struct node* alternative;
+    struct node* next;
+};
+
+// Instructions of a compiled program, with their operands:
+//   OP_RUN command                 run a command
+//   OP_JUMP target                 continue at target
+//   OP_JUMP_IF_FAILED target       continue at target unless the last command exited with 0
+//   OP_FOR_START command           expand the word list of a for loop and start a loop frame
+//   OP_FOR_NEXT name target        set the variable to the next word, or drop the frame and jump
+//   OP_FOR_END                     drop the loop frame, for break
+//   OP_DEFINE name function        define a shell function
+//   OP_RETURN command              end the program, with the exit value given by the command's word
+#define OP_RUN 0
+#define OP_JUMP 1
+#define OP_JUMP_IF_FAILED 2
+#define OP_FOR_START 3
+#define OP_FOR_NEXT 4
+#define OP_FOR_END 5
+#define OP_DEFINE 6
+#define OP_RETURN 7
+
+// A compiled compound command or function body: its code and the commands, names and function
+// bodies its operands refer to. Programs are freed when their last reference is released; function
+// bodies are referred to by the program that defines them and by the function table
+struct program {
+    int* code;
+    int length;
+    struct cached_command** commands;
+    int command_count;
+    char** names;
+    int name_count;
+    struct program** functions;
+    int function_count;
+    int references;
+};
+
+// Where continue jumps to in the loop being compiled, and the break jumps still to be patched
+struct loop_context {
+    int continue_target;
+    int* breaks;
+    int break_count;
+};
+
+// A for loop being run: its expanded words, the next one to use and the arena position to go back
+// to when the loop ends
+struct loop_frame {
+    char** words;
+    int next_word;
+    struct arena_mark mark;
+    struct loop_frame* outer;
+};
+
+// Shell functions by name, and how deeply function calls may nest
+#define MAX_FUNCTION_DEPTH 1000
+struct function {
+    char* name;
+    struct program* program;
+    struct function* next;
+};
+struct function* function_list = NULL;
+
+// Bookkeeping for the jobs started by one 'parallel' builtin
+struct job_group {
+    int running;
+    int failed;
+};
+
+// Directory of the shell-owned cgroup v2 subtree that jobs are placed in, NULL when cgroup mode is off,
+// and the number of job cgroups created in it so far
+char* cgroup_root = NULL;
+int cgroup_job_count = 0;
+
+// Controllers the job cgroups need for their limits and accounting
+char* cgroup_controllers[] = { "cpu", "memory", "io", NULL };
+
+// Per-job settings given as @name=value words in front of a command. node is -1 when not given
+struct job_options {
+    char* memory_max;
+    char* cpu_max;
+    char* io_max;
+    char* cpus;
+    int node;
+};
+
+// Memory policy modes of set_mempolicy(2), which has no glibc header
+#define MPOL_DEFAULT 0
+#define MPOL_BIND 2
+#define MAX_NUMA_NODES 1024
+
+// Automatic placement of background jobs: off, round-robin over CPUs or round-robin over NUMA nodes,
+// and the CPU or node the last job was placed on
+#define PLACEMENT_OFF 0
+#define PLACEMENT_CPU 1
+#define PLACEMENT_NODE 2
+int placement_mode = PLACEMENT_OFF;
+int placement_last = -1;
+
+// The shell's own CPU affinity and memory policy, saved while a job is launched with different ones
+struct saved_placement {
+    cpu_set_t cpus;
+    int changed_cpus;
+    int mode;
+    unsigned long nodes[MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+    int changed_memory;
+};
+
+// Accounting for a pipeline that runs under the 'time' keyword or in its own cgroup: the summed
+// rusage of its reaped stages, when it started, how many of its stages are still running and the
+// path of its cgroup (NULL if none)
+struct job_usage {
+    struct rusage usage;
+    struct timespec start;
+    int running;
+    int timed;
+    char* cgroup;
+};
+
+// Background processes that have not been reaped yet. Each one is watched through a pidfd when the
+// kernel supports it, otherwise its pidfd is -1 and it is polled with waitpid(). Only the last stage
+// of a background pipeline is reported when it finishes, unless the job belongs to a group, which
+// is told instead. Stages of a timed or cgroup pipeline share a job_usage. The list is doubly linked
+// so a reaped job is unlinked without walking it
+struct job {
+    pid_t pid;
+    int pidfd;
+    int report;
+    struct job_group* group;
+    struct job_usage* usage;
+    struct job* prev;
+    struct job* next;
+};
+struct job* job_list = NULL;
+
+// The epoll instance driving the main loop, and whether stdin could be added to it
+int event_fd = -1;
+int stdin_watched = 0;
+
+// Ways of running the event loop
+#define EVENTS_PENDING 0
+#define EVENTS_INPUT 1
+#define EVENTS_ONCE 2
+
+// SIGCHLD, SIGTSTP and SIGINT are blocked and read from this signalfd by the main loop
+int signal_fd = -1;
+sigset_t shell_signals;
+
+// Set when SIGINT is read from the signalfd, so builtins that keep starting jobs know to stop
+int interrupt_received = 0;
+
+/*
+    Function that toggles foreground-only mode when the shell receives SIGTSTP
+*/
+void handle_SIGTSTP(void) {
+    if (foreground_mode_flag == 0) {
+        // Foreground-only mode is entered and the user is notified
+        printf("\nEntering foreground-only mode (& is now ignored)\n");
+        foreground_mode_flag = 1;
+    }
+    else {
+        // Foreground-only mode has been exited and the user is notified
+        printf("\nExiting foreground-only mode\n");
+        foreground_mode_flag = 0;
+    }
+    fflush(stdout);
+}
+
+/*
+    Function that allocates memory from the command line arena. A new block is chained on when none
+    of the remaining blocks has room
+*/
+void* arena_alloc(size_t size) {
+    struct arena_block* block;
+    size = (size + 15) & ~(size_t)15;
+    while (arena_current == NULL || arena_current->used + size > arena_current->size) {
+        if (arena_current != NULL && arena_current->next != NULL) {
+            arena_current = arena_current->next;
+            continue;
+        }
+        block = malloc(sizeof(struct arena_block) + (size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE));
+        if (block == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        block->next = NULL;
+        block->size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block->used = 0;
+        if (arena_current == NULL) {
+            arena_first = block;
+        }
+        else {
+            arena_current->next = block;
+        }
+        arena_current = block;
+    }
+    arena_current->used += size;
+    return arena_current->data + arena_current->used - size;
+}
+
+/*
+    Function that returns the current position in the arena
+*/
+struct arena_mark arena_save(void) {
+    struct arena_mark mark = { arena_current, arena_current != NULL ? arena_current->used : 0 };
+    return mark;
+}
+
+/*
+    Function that frees everything allocated from the arena since mark was saved
+*/
+void arena_release(struct arena_mark mark) {
+    struct arena_block* block;
+    arena_current = mark.block != NULL ? mark.block : arena_first;
+    if (arena_current == NULL) {
+        return;
+    }
+    arena_current->used = mark.block != NULL ? mark.used : 0;
+    for (block = arena_current->next; block != NULL; block = block->next) {
+        block->used = 0;
+    }
+}
+
+/*
+    Function that frees everything allocated from the arena, ready for the next command line
+*/
+void arena_reset(void) {
+    struct arena_mark start = { NULL, 0 };
+    arena_release(start);
+}
+
+/*
+    Function that finds the next byte in scan_stops one byte at a time
+*/
+char* scan_special_scalar(char* text) {
+    while (!scan_stops[(unsigned char)*text]) {
+        text++;
+    }
+    return text;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+    Function that finds the next byte in scan_stops 16 bytes at a time with SSE2. Blocks are loaded
+    from 16-byte aligned addresses, so no load crosses into a page that the string does not reach
+*/
+__attribute__((target("sse2")))
+char* scan_special_sse2(char* text) {
+    uintptr_t offset = (uintptr_t)text & 15;
+    __m128i* block = (__m128i*)(text - offset);
+    __m128i blank = _mm_set1_epi8(' ');
+    unsigned int mask;
+    for (mask = ~0U << offset; ; block++, mask = ~0U) {
+        __m128i bytes = _mm_load_si128(block);
+        __m128i found = _mm_cmpeq_epi8(_mm_min_epu8(bytes, blank), bytes);
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('<')));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('>')));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('|')));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\'')));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"')));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\')));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('$')));
+        mask &= _mm_movemask_epi8(found);
+        if (mask != 0) {
+            return (char*)block + __builtin_ctz(mask);
+        }
+    }
+}
+
+/*
+    Function that finds the next byte in scan_stops 32 bytes at a time with AVX2, in the same way
+    as scan_special_sse2
+*/
+__attribute__((target("avx2")))
+char* scan_special_avx2(char* text) {
+    uintptr_t offset = (uintptr_t)text & 31;
+    __m256i* block = (__m256i*)(text - offset);
+    __m256i blank = _mm256_set1_epi8(' ');
+    unsigned int mask;
+    for (mask = ~0U << offset; ; block++, mask = ~0U) {
+        __m256i bytes = _mm256_load_si256(block);
+        __m256i found = _mm256_cmpeq_epi8(_mm256_min_epu8(bytes, blank), bytes);
+        found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('<')));
+        found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('>')));
+        found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('|')));
+        found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\'')));
+        found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('"')));
+        found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\\')));
+        found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('$')));
+        mask &= (unsigned int)_mm256_movemask_epi8(found);
+        if (mask != 0) {
+            return (char*)block + __builtin_ctz(mask);
+        }
+    }
+}
+#endif
+
+/*
+    Function that fills in scan_stops and picks the fastest scanner the CPU supports
+*/
+void init_scanner(void) {
+    int c;
+    for (c = 0; c < 256; c++) {
+        scan_stops[c] = c <= ' ' || char_classes[c] != CHAR_WORD;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_special = scan_special_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        scan_special = scan_special_sse2;
+    }
+#endif
+}
+
+/*
+    Function that finds the next EXPANSION_MARK or EXPANSION_BOUNDARY in a word, or returns NULL if
+    there is none
+*/
+char* find_mark(char* text) {
+    while (*(text = scan_special(text)) != EXPANSION_MARK && *text != EXPANSION_BOUNDARY) {
+        if (*text == '\0') {
+            return NULL;
+        }
+        text++;
+    }
+    return text;
+}
+
+/*
+    Function that returns the value of an environment variable whose name is not null-terminated,
+    or NULL if it is not set
+*/
+char* lookup_variable(char* name, size_t length) {
+    char** entry;
+    for (entry = environ; *entry != NULL; entry++) {
+        if (strncmp(*entry, name, length) == 0 && (*entry)[length] == '=') {
+            return *entry + length + 1;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Function that returns the exit value of the last foreground command, or 128 plus the signal
+    that ended it
+*/
+int last_exit_value(void) {
+    if (child_exit_status == -5) {
+        return 0;
+    }
+    return WIFEXITED(child_exit_status) ? WEXITSTATUS(child_exit_status) : 128 + WTERMSIG(child_exit_status);
+}
+
+/*
+    Function that reads the expansion starting at the EXPANSION_MARK at *cursor and moves the cursor
+    past it. Its value is returned and its length stored in length; numbers are formatted into
+    buffer. A mark that does not start $$, $?, $!, $#, $NAME or ${NAME} is a plain $, in which case
+    NULL is returned
+*/
+char* expansion_value(char** cursor, size_t* length, char* buffer) {
+    char* name = *cursor + 1;
+    char* end = name;
+    char* value;
+    int index;
+
+    switch (*name) {
+        case EXPANSION_MARK:
+            *cursor = name + 1;
+            *length = pid_length;
+            return pid_string;
+        case '?':
+            *cursor = name + 1;
+            *length = sprintf(buffer, "%d", last_exit_value());
+            return buffer;
+        case '!':
+            *cursor = name + 1;
+            *length = strlen(last_background_pid);
+            return last_background_pid;
+        case '#':
+            *cursor = name + 1;
+            *length = sprintf(buffer, "%d", argument_count);
+            return buffer;
+        case '{':
+            end = ++name;
+            break;
+    }
+
+    // A digit is a positional argument, and more than one digit needs braces as in ${10}
+    if (*end >= '0' && *end <= '9') {
+        index = *end++ - '0';
+        while (name[-1] == '{' && *end >= '0' && *end <= '9') {
+            index = index * 10 + *end++ - '0';
+        }
+        if (name[-1] == '{' && *end != '}') {
+            *cursor += 1;
+            *length = 1;
+            return NULL;
+        }
+        value = index <= argument_count ? arguments[index] : "";
+        *cursor = name[-1] == '{' ? end + 1 : end;
+        *length = strlen(value);
+        return value;
+    }
+
+    // A variable name is a letter or underscore followed by letters, digits and underscores
+    if ((*end >= 'a' && *end <= 'z') || (*end >= 'A' && *end <= 'Z') || *end == '_') {
+        while ((*end >= 'a' && *end <= 'z') || (*end >= 'A' && *end <= 'Z') || (*end >= '0' && *end <= '9') || *end == '_') {
+            end++;
+        }
+    }
+    if (end == name || (name[-1] == '{' && *end != '}')) {
+        *cursor += 1;
+        *length = 1;
+        return NULL;
+    }
+    value = lookup_variable(name, end - name);
+    *cursor = name[-1] == '{' ? end + 1 : end;
+    *length = value != NULL ? strlen(value) : 0;
+    return value != NULL ? value : "";
+}
+
+char* substitute_commands(char* word);
+
+/*
+    Function that expands a word from the lexer, where every unquoted $ has been turned into
+    EXPANSION_MARK and removed quotes have left EXPANSION_BOUNDARY bytes. A first pass measures the
+    result so it can be built in an arena string of exactly the right size by the second. Words
+    without expansions only get their $ back and lose their boundaries, which is done in place. Both
+    passes are linear in the length of the word. Command substitutions are replaced by their output
+    before, so that they run once
+*/
+char* expand_word(char* word) {
+    char buffer[16];
+    char *cursor, *mark, *value, *replacement, *out;
+    size_t size = 0, length;
+    int expanded = 0;
+
+    if (strstr(word, (char[]){ EXPANSION_MARK, '(', '\0' }) != NULL) {
+        word = substitute_commands(word);
+    }
+
+    for (cursor = word; (mark = find_mark(cursor)) != NULL; ) {
+        size += mark - cursor;
+        cursor = mark;
+        if (*mark == EXPANSION_BOUNDARY) {
+            cursor++;
+            continue;
+        }
+        expanded |= expansion_value(&cursor, &length, buffer) != NULL;
+        size += length;
+    }
+    size += strlen(cursor);
+
+    // The result is never longer than the word when nothing is expanded
+    out = replacement = expanded ? arena_alloc(size + 1) : word;
+    for (cursor = word; (mark = find_mark(cursor)) != NULL; ) {
+        memmove(out, cursor, mark - cursor);
+        out += mark - cursor;
+        cursor = mark;
+        if (*mark == EXPANSION_BOUNDARY) {
+            cursor++;
+            continue;
+        }
+        value = expansion_value(&cursor, &length, buffer);
+        memcpy(out, value != NULL ? value : "$", length);
+        out += length;
+    }
+    memmove(out, cursor, strlen(cursor) + 1);
+    return replacement;
+}
+
+/*
+    Function that computes the hash table bucket of a command name
+*/
+unsigned int hash_command_name(char* name) {
+    unsigned int hash = 5381;
+    while (*name) {
+        hash = hash * 33 + (unsigned char)*name++;
+    }
+    return hash % HASH_TABLE_SIZE;
+}
+
+/*
+    Function that removes every entry from the command hash table
+*/
+void clear_hash_table(void) {
+    int i;
+    for (i = 0; i < HASH_TABLE_SIZE; i++) {
+        while (hash_table[i] != NULL) {
+            struct hash_entry* entry = hash_table[i];
+            hash_table[i] = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+    }
+}
+
+/*
+    Function that records the modification time of a PATH directory, or zero if it cannot be read
+*/
+void stat_path_dir(int index) {
+    struct stat dir_info;
+    if (stat(hashed_path_dirs[index], &dir_info) == 0) {
+        hashed_path_mtimes[index] = dir_info.st_mtim;
+    }
+    else {
+        memset(&hashed_path_mtimes[index], 0, sizeof(struct timespec));
+    }
+}
+
+/*
+    Function that splits the given PATH value into its directories and empties the hash table
+*/
+void rebuild_path_dirs(char* path) {
+    char* dir;
+    int i;
+    clear_hash_table();
+    for (i = 0; i < hashed_path_dir_count; i++) {
+        free(hashed_path_dirs[i]);
+    }
+    free(hashed_path_dirs);
+    free(hashed_path_mtimes);
+    free(hashed_path);
+    hashed_path = strdup(path);
+
+    // Every ':' starts another directory, and an empty directory means the current one
+    hashed_path_dir_count = 1;
+    for (dir = path; *dir; dir++) {
+        if (*dir == ':') {
+            hashed_path_dir_count++;
+        }
+    }
+    hashed_path_dirs = malloc(hashed_path_dir_count * sizeof(char*));
+    hashed_path_mtimes = malloc(hashed_path_dir_count * sizeof(struct timespec));
+    for (i = 0, dir = path; i < hashed_path_dir_count; i++) {
+        size_t length = strcspn(dir, ":");
+        hashed_path_dirs[i] = length == 0 ? strdup(".") : strndup(dir, length);
+        stat_path_dir(i);
+        dir += length + 1;
+    }
+}
+
+/*
+    Function that checks whether any PATH directory up to and including the given one was modified
+    since it was hashed, in which case a command could now resolve to a different file
+*/
+int path_dirs_changed(int last_index) {
+    struct stat dir_info;
+    int i;
+    for (i = 0; i <= last_index; i++) {
+        struct timespec old_mtime = hashed_path_mtimes[i];
+        if (stat(hashed_path_dirs[i], &dir_info) != 0) {
+            memset(&dir_info.st_mtim, 0, sizeof(struct timespec));
+        }
+        if (dir_info.st_mtim.tv_sec != old_mtime.tv_sec || dir_info.st_mtim.tv_nsec != old_mtime.tv_nsec) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Function that resolves a command name to an executable file through the hash table, searching
+    PATH only on a miss. Names containing a '/' are returned unchanged and NULL means not found
+*/
+char* lookup_command(char* name) {
+    char* path = getenv("PATH");
+    struct hash_entry* entry;
+    unsigned int bucket;
+    int i;
+
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+    if (path == NULL) {
+        path = "/bin:/usr/bin";
+    }
+
+    // A reassigned PATH invalidates everything that was hashed
+    if (hashed_path == NULL || strcmp(hashed_path, path) != 0) {
+        rebuild_path_dirs(path);
+    }
+
+    bucket = hash_command_name(name);
+    for (entry = hash_table[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            break;
+        }
+    }
+    if (entry != NULL) {
+        if (!path_dirs_changed(entry->dir_index)) {
+            entry->hits++;
+            return entry->path;
+        }
+        // A directory changed, so the stale entries are dropped and the modification times refreshed
+        clear_hash_table();
+        for (i = 0; i < hashed_path_dir_count; i++) {
+            stat_path_dir(i);
+        }
+    }
+
+    // Search the PATH directories in order for an executable regular file
+    for (i = 0; i < hashed_path_dir_count; i++) {
+        struct stat file_info;
+        char* candidate = malloc(strlen(hashed_path_dirs[i]) + strlen(name) + 2);
+        sprintf(candidate, "%s/%s", hashed_path_dirs[i], name);
+        if (stat(candidate, &file_info) == 0 && S_ISREG(file_info.st_mode) && access(candidate, X_OK) == 0) {
+            entry = malloc(sizeof(struct hash_entry));
+            entry->name = strdup(name);
+            entry->path = candidate;
+            entry->dir_index = i;
+            entry->hits = 1;
+            entry->next = hash_table[bucket];
+            hash_table[bucket] = entry;
+            return candidate;
+        }
+        free(candidate);
+    }
+    return NULL;
+}
+
+/*
+    Function that implements the 'hash' builtin: with no arguments the hashed commands are listed,
+    and 'hash -r' forgets all of them
+*/
+void hash_builtin(char** command_line) {
+    int i, empty = 1;
+    struct hash_entry* entry;
+
+    if (command_line[1] != NULL && strcmp(command_line[1], "-r") == 0) {
+        clear_hash_table();
+        return;
+    }
+    for (i = 0; i < HASH_TABLE_SIZE; i++) {
+        for (entry = hash_table[i]; entry != NULL; entry = entry->next) {
+            if (empty) {
+                printf("hits\tcommand\n");
+                empty = 0;
+            }
+            printf("%4d\t%s\n", entry->hits, entry->path);
+        }
+    }
+    if (empty) {
+        printf("hash: hash table empty\n");
+    }
+    fflush(stdout);
+}
+
+/*
+    Function that moves an fd the shell keeps for itself to SHELL_FD_MIN or above, close-on-exec.
+    Returns the new fd, or fd itself if it is -1, already there or cannot be moved
+*/
+int move_shell_fd(int fd) {
+    int moved;
+    if (fd == -1 || fd >= SHELL_FD_MIN || (moved = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_MIN)) == -1) {
+        return fd;
+    }
+    close(fd);
+    return moved;
+}
+
+/*
+    Function that opens a pidfd for a child, or returns -1 when pidfds are not supported
+*/
+int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return move_shell_fd(syscall(SYS_pidfd_open, pid, 0));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+    Function that creates the epoll instance and adds stdin and the signalfd to it. Regular files
+    cannot be watched by epoll, in which case stdin is treated as always readable
+*/
+void init_event_loop(void) {
+    struct epoll_event event = { 0 };
+    event_fd = move_shell_fd(epoll_create1(EPOLL_CLOEXEC));
+    if (event_fd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    stdin_watched = epoll_ctl(event_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == 0;
+
+    // The signals are blocked so they are only delivered through the signalfd
+    sigemptyset(&shell_signals);
+    sigaddset(&shell_signals, SIGCHLD);
+    sigaddset(&shell_signals, SIGTSTP);
+    sigaddset(&shell_signals, SIGINT);
+    sigprocmask(SIG_BLOCK, &shell_signals, NULL);
+    signal_fd = move_shell_fd(signalfd(-1, &shell_signals, SFD_NONBLOCK | SFD_CLOEXEC));
+    if (signal_fd == -1) {
+        perror("signalfd");
+        exit(1);
+    }
+    event.data.ptr = &signal_fd;
+    epoll_ctl(event_fd, EPOLL_CTL_ADD, signal_fd, &event);
+}
+
+/*
+    Function that adds the resource usage of a reaped child to a running total. Times and context
+    switches are summed and the largest maximum RSS is kept
+*/
+void add_rusage(struct rusage* total, struct rusage* usage) {
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    if (usage->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+/*
+    Function that prints the wall time since start and the resource usage of a timed command
+*/
+void print_rusage(struct rusage* usage, struct timespec* start) {
+    struct timespec now;
+    double wall;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    wall = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+    printf("real %.3fs  user %ld.%03lds  sys %ld.%03lds  max rss %ld KB  context switches %ld voluntary, %ld involuntary\n",
+           wall, (long)usage->ru_utime.tv_sec, (long)usage->ru_utime.tv_usec / 1000,
+           (long)usage->ru_stime.tv_sec, (long)usage->ru_stime.tv_usec / 1000,
+           usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
+}
+
+/*
+    Function that prints the usage of a timed command the shell ran itself, a builtin or a function:
+    the wall time since start and what the shell and the children it reaped used since self_before
+    and children_before were taken. The maximum RSS of the children only counts if one of them set
+    a new peak meanwhile
+*/
+void print_shell_usage(struct rusage* self_before, struct rusage* children_before, struct timespec* start) {
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    timersub(&self.ru_utime, &self_before->ru_utime, &self.ru_utime);
+    timersub(&self.ru_stime, &self_before->ru_stime, &self.ru_stime);
+    self.ru_nvcsw -= self_before->ru_nvcsw;
+    self.ru_nivcsw -= self_before->ru_nivcsw;
+    timersub(&children.ru_utime, &children_before->ru_utime, &children.ru_utime);
+    timersub(&children.ru_stime, &children_before->ru_stime, &children.ru_stime);
+    children.ru_nvcsw -= children_before->ru_nvcsw;
+    children.ru_nivcsw -= children_before->ru_nivcsw;
+    if (children.ru_maxrss == children_before->ru_maxrss) {
+        children.ru_maxrss = 0;
+    }
+    add_rusage(&self, &children);
+    print_rusage(&self, start);
+    fflush(stdout);
+}
+
+/*
+    Function that writes a value to a file inside a cgroup directory. Returns -1 on failure
+*/
+int write_cgroup_file(char* cgroup, char* name, char* value) {
+    char path[4096];
+    int fd, result;
+    snprintf(path, sizeof(path), "%s/%s", cgroup, name);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    result = write(fd, value, strlen(value)) == (ssize_t)strlen(value) ? 0 : -1;
+    close(fd);
+    return result;
+}
+
+/*
+    Function that reads a file inside a cgroup directory into buffer. Returns -1 on failure
+*/
+int read_cgroup_file(char* cgroup, char* name, char* buffer, size_t size) {
+    char path[4096];
+    ssize_t length;
+    int fd;
+    snprintf(path, sizeof(path), "%s/%s", cgroup, name);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    length = read(fd, buffer, size - 1);
+    close(fd);
+    if (length < 0) {
+        return -1;
+    }
+    buffer[length] = '\0';
+    return 0;
+}
+
+/*
+    Function that removes the shell's cgroup subtree when cgroup mode ends or the shell exits. Job
+    cgroups still holding processes are left behind
+*/
+void remove_cgroup_root(void) {
+    // A subshell exiting leaves the subtree to the shell it was forked from
+    if (cgroup_root != NULL && getpid() == atoi(pid_string)) {
+        rmdir(cgroup_root);
+    }
+    if (cgroup_root != NULL) {
+        free(cgroup_root);
+        cgroup_root = NULL;
+    }
+}
+
+/*
+    Function that returns whether a space separated list of controllers, as in cgroup.controllers,
+    has the named one
+*/
+int has_controller(char* list, char* name) {
+    size_t length = strlen(name);
+    char* word = list;
+    while ((word = strstr(word, name)) != NULL) {
+        if ((word == list || word[-1] == ' ') &&
+            (word[length] == ' ' || word[length] == '\n' || word[length] == '\0')) {
+            return 1;
+        }
+        word += length;
+    }
+    return 0;
+}
+
+/*
+    Function that finds where the cgroup v2 hierarchy is mounted, which is /sys/fs/cgroup/unified
+    rather than /sys/fs/cgroup on hosts that still mount v1 hierarchies. Returns -1 if it is not
+*/
+int find_cgroup2_mount(char* mount_point, size_t size) {
+    char *line = NULL, *separator;
+    size_t line_size = 0;
+    FILE* mounts = fopen("/proc/self/mountinfo", "r");
+    int found = -1;
+    if (mounts == NULL) {
+        return -1;
+    }
+    // Each line has the mount point as its fifth field and the file system type after " - "
+    while (found == -1 && getline(&line, &line_size, mounts) != -1) {
+        separator = strstr(line, " - ");
+        if (separator != NULL && strncmp(separator + 3, "cgroup2 ", 8) == 0 &&
+            sscanf(line, "%*s %*s %*s %*s %4095s", mount_point) == 1 && strlen(mount_point) < size) {
+            found = 0;
+        }
+    }
+    free(line);
+    fclose(mounts);
+    return found;
+}
+
+/*
+    Function that makes sure the controllers the job cgroups need reach the children of a cgroup,
+    by enabling each one the cgroup has in its cgroup.subtree_control. A controller the cgroup does
+    not have at all is left out, and reported if report is set. Returns -1, with the reason printed,
+    if one that it has cannot be enabled, which is what happens when it is not delegated to the user
+    or has processes of its own
+*/
+int enable_cgroup_controllers(char* cgroup, int report) {
+    char available[4096], enabled[4096], value[32];
+    int i;
+    if (read_cgroup_file(cgroup, "cgroup.controllers", available, sizeof(available)) == -1 ||
+        read_cgroup_file(cgroup, "cgroup.subtree_control", enabled, sizeof(enabled)) == -1) {
+        printf("cgroup: %s is not a cgroup v2 directory\n", cgroup);
+        return -1;
+    }
+    for (i = 0; cgroup_controllers[i] != NULL; i++) {
+        if (!has_controller(available, cgroup_controllers[i])) {
+            if (report) {
+                printf("cgroup: no %s controller in %s, its limits and accounting are not available\n",
+                       cgroup_controllers[i], cgroup);
+            }
+            continue;
+        }
+        sprintf(value, "+%s", cgroup_controllers[i]);
+        if (!has_controller(enabled, cgroup_controllers[i]) &&
+            write_cgroup_file(cgroup, "cgroup.subtree_control", value) == -1) {
+            printf("cgroup: cannot enable the %s controller in %s: %s\n", cgroup_controllers[i], cgroup,
+                   strerror(errno));
+            printf("cgroup: %s must be delegated to you and have no processes of its own\n", cgroup);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Function that implements the 'cgroup' builtin. 'cgroup on [DIR]' creates a subtree owned by the
+    shell under DIR, and runs every following job in its own leaf cgroup there. DIR must be a cgroup
+    v2 directory delegated to the user without processes of its own, such as a scope started with
+    'systemd-run --user --scope -p Delegate=yes', because the controllers can only be passed on from
+    such a cgroup (default: the shell's own cgroup, which only works when it is the root).
+    'cgroup off' stops that and 'cgroup' alone shows the current subtree
+*/
+void cgroup_builtin(char** command_line) {
+    char parent[4096], mount_point[4096], path[4200], buffer[4096], *line;
+    static int cleanup_registered = 0;
+
+    if (command_line[1] == NULL) {
+        printf("%s\n", cgroup_root != NULL ? cgroup_root : "cgroup mode is off");
+    }
+    else if (strcmp(command_line[1], "off") == 0) {
+        remove_cgroup_root();
+    }
+    else if (strcmp(command_line[1], "on") == 0) {
+        if (command_line[2] != NULL) {
+            snprintf(parent, sizeof(parent), "%s", command_line[2]);
+        }
+        else {
+            // The cgroup v2 entry of /proc/self/cgroup is the line starting with "0::", with a path
+            // relative to where the hierarchy is mounted
+            if (read_cgroup_file("/proc/self", "cgroup", buffer, sizeof(buffer)) == -1 ||
+                (line = strstr(buffer, "0::")) == NULL || (line != buffer && line[-1] != '\n') ||
+                find_cgroup2_mount(mount_point, sizeof(mount_point)) == -1) {
+                printf("cgroup: cgroup v2 is not available\n");
+                fflush(stdout);
+                return;
+            }
+            line[3 + strcspn(line + 3, "\n")] = '\0';
+            snprintf(parent, sizeof(parent), "%s%s", mount_point, strcmp(line + 3, "/") == 0 ? "" : line + 3);
+        }
+        remove_cgroup_root();
+        // The controllers have to be passed on twice, by the parent to the subtree and by the
+        // subtree to the job cgroups
+        snprintf(path, sizeof(path), "%s/smallsh-%d", parent, getpid());
+        // Only the root may have processes next to child cgroups that use controllers, and it is the
+        // one cgroup without a cgroup.type
+        if (read_cgroup_file(parent, "cgroup.type", buffer, sizeof(buffer)) == 0 &&
+            read_cgroup_file(parent, "cgroup.procs", buffer, sizeof(buffer)) == 0 && buffer[0] != '\0') {
+            printf("cgroup: %s has processes of its own, use an empty cgroup delegated to you\n", parent);
+            fflush(stdout);
+            return;
+        }
+        if (enable_cgroup_controllers(parent, 1) == -1) {
+            fflush(stdout);
+            return;
+        }
+        if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+            printf("cgroup: cannot create %s: %s\n", path, strerror(errno));
+            fflush(stdout);
+            return;
+        }
+        if (enable_cgroup_controllers(path, 0) == -1) {
+            rmdir(path);
+            fflush(stdout);
+            return;
+        }
+        cgroup_root = strdup(path);
+        if (!cleanup_registered) {
+            atexit(remove_cgroup_root);
+            cleanup_registered = 1;
+        }
+    }
+    else {
+        printf("cgroup: usage: cgroup [on [DIR] | off]\n");
+    }
+    fflush(stdout);
+}
+
+/*
+    Function that reads a "key value" entry from the text of a cgroup stat file, or -1 if missing
+*/
+long long cgroup_stat_value(char* text, char* key) {
+    size_t length = strlen(key);
+    char* line = text;
+    while (line != NULL) {
+        if (strncmp(line, key, length) == 0 && line[length] == ' ') {
+            return atoll(line + length + 1);
+        }
+        line = strchr(line, '\n');
+        if (line != NULL) {
+            line++;
+        }
+    }
+    return -1;
+}
+
+/*
+    Function that creates the leaf cgroup for a new job and applies its limits. An open directory fd
+    of the cgroup is returned for CLONE_INTO_CGROUP, or -1 if it could not be set up
+*/
+int create_job_cgroup(struct job_usage* usage, struct job_options* options) {
+    char path[4096];
+    char* names[] = { "memory.max", "cpu.max", "io.max" };
+    char* values[] = { options->memory_max, options->cpu_max, options->io_max };
+    int fd, i;
+    snprintf(path, sizeof(path), "%s/job-%d", cgroup_root, ++cgroup_job_count);
+    if (mkdir(path, 0755) == -1) {
+        printf("cgroup: cannot create %s: %s\n", path, strerror(errno));
+        fflush(stdout);
+        return -1;
+    }
+    for (i = 0; i < 3; i++) {
+        if (values[i] != NULL && write_cgroup_file(path, names[i], values[i]) == -1) {
+            printf("cgroup: cannot write %s to %s/%s: %s\n", values[i], path, names[i], strerror(errno));
+            fflush(stdout);
+            rmdir(path);
+            return -1;
+        }
+    }
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        printf("cgroup: cannot open %s: %s\n", path, strerror(errno));
+        fflush(stdout);
+        rmdir(path);
+        return -1;
+    }
+    usage->cgroup = strdup(path);
+    return fd;
+}
+
+/*
+    Function that is called once every stage of a timed or cgroup pipeline has been reaped. It
+    prints the rusage summary and the cgroup's cpu.stat and memory.peak if report is set, then
+    removes the job's cgroup and frees the record
+*/
+void finish_job_usage(struct job_usage* usage, int report) {
+    char buffer[4096];
+    long long memory_peak;
+    if (report && usage->timed) {
+        print_rusage(&usage->usage, &usage->start);
+    }
+    if (usage->cgroup != NULL) {
+        if (report && read_cgroup_file(usage->cgroup, "cpu.stat", buffer, sizeof(buffer)) == 0) {
+            printf("cgroup %s: cpu %.3fs  user %.3fs  system %.3fs", strrchr(usage->cgroup, '/') + 1,
+                   cgroup_stat_value(buffer, "usage_usec") / 1e6, cgroup_stat_value(buffer, "user_usec") / 1e6,
+                   cgroup_stat_value(buffer, "system_usec") / 1e6);
+            memory_peak = -1;
+            if (read_cgroup_file(usage->cgroup, "memory.peak", buffer, sizeof(buffer)) == 0) {
+                memory_peak = atoll(buffer);
+            }
+            if (memory_peak >= 0) {
+                printf("  memory peak %lld KB", memory_peak / 1024);
+            }
+            printf("\n");
+        }
+        rmdir(usage->cgroup);
+        free(usage->cgroup);
+    }
+    fflush(stdout);
+    free(usage);
+}
+
+/*
+    Function that records an @name=value job setting. In cgroup limits commas stand for spaces, as
+    in @cpu.max=50000,100000. Returns -1 for an unknown setting
+*/
+int set_job_option(struct job_options* options, char* word) {
+    char* value = strchr(word, '=') + 1;
+    char* comma;
+    if (strncmp(word, "@cpus=", 6) == 0) {
+        options->cpus = value;
+        return 0;
+    }
+    else if (strncmp(word, "@node=", 6) == 0) {
+        options->node = atoi(value);
+        return 0;
+    }
+    while ((comma = strchr(value, ',')) != NULL) {
+        *comma = ' ';
+    }
+    if (strncmp(word, "@memory.max=", 12) == 0) {
+        options->memory_max = value;
+    }
+    else if (strncmp(word, "@cpu.max=", 9) == 0) {
+        options->cpu_max = value;
+    }
+    else if (strncmp(word, "@io.max=", 8) == 0) {
+        options->io_max = value;
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Function that records a background job and starts watching its pidfd
+*/
+void add_background_job(pid_t pid, int report, struct job_group* group, struct job_usage* usage) {
+    struct epoll_event event = { 0 };
+    struct job* job = malloc(sizeof(struct job));
+    job->pid = pid;
+    job->report = report;
+    job->group = group;
+    job->usage = usage;
+    job->pidfd = open_pidfd(pid);
+    if (job->pidfd != -1) {
+        event.events = EPOLLIN;
+        event.data.ptr = job;
+        if (epoll_ctl(event_fd, EPOLL_CTL_ADD, job->pidfd, &event) == -1) {
+            close(job->pidfd);
+            job->pidfd = -1;
+        }
+    }
+    job->prev = NULL;
+    job->next = job_list;
+    if (job_list != NULL) {
+        job_list->prev = job;
+    }
+    job_list = job;
+}
+
+/*
+    Function that reaps a background process if it has finished, reports how it ended and forgets it.
+    Returns 1 if a report was printed
+*/
+int reap_background_job(struct job* job) {
+    struct rusage usage;
+    int job_exit_status;
+    int reported = job->report && job->group == NULL;
+    if (wait4(job->pid, &job_exit_status, WNOHANG, &usage) <= 0) {
+        return 0;
+    }
+    if (job->usage != NULL) {
+        add_rusage(&job->usage->usage, &usage);
+        job->usage->running--;
+    }
+    if (job->report && job->group != NULL) {
+        // The group's slot is freed when the last stage of its job finishes
+        job->group->running--;
+        if (!WIFEXITED(job_exit_status) || WEXITSTATUS(job_exit_status) != 0) {
+            job->group->failed++;
+        }
+    }
+    if (reported) {
+        printf("background pid %i is done: ", job->pid);
+        if (WIFEXITED(job_exit_status)) {
+            printf("exit value %i\n", WEXITSTATUS(job_exit_status));
+        }
+        else {
+            printf("terminated by signal %i\n", job_exit_status);
+        }
+        fflush(stdout);
+    }
+    if (job->usage != NULL && job->usage->running == 0) {
+        finish_job_usage(job->usage, job->group == NULL);
+        reported = job->group == NULL;
+    }
+
+    // Closing the pidfd also removes it from the epoll instance
+    if (job->pidfd != -1) {
+        close(job->pidfd);
+    }
+    if (job->prev != NULL) {
+        job->prev->next = job->next;
+    }
+    else {
+        job_list = job->next;
+    }
+    if (job->next != NULL) {
+        job->next->prev = job->prev;
+    }
+    free(job);
+    return reported;
+}
+
+/*
+    Function that reads every pending signal from the signalfd and handles them in one batch.
+    Returns 1 if anything was printed, so the caller knows to show the prompt again
+*/
+int handle_signals(void) {
+    struct signalfd_siginfo info[16];
+    struct job *job, *next;
+    int i, received_SIGCHLD = 0, printed = 0;
+    ssize_t bytes;
+
+    while ((bytes = read(signal_fd, info, sizeof(info))) > 0) {
+        for (i = 0; i < bytes / (ssize_t)sizeof(struct signalfd_siginfo); i++) {
+            switch (info[i].ssi_signo) {
+                case SIGCHLD:
+                    received_SIGCHLD = 1;
+                    break;
+                case SIGTSTP:
+                    handle_SIGTSTP();
+                    printed = 1;
+                    break;
+                case SIGINT:
+                    // The shell itself ignores SIGINT, the line is just abandoned
+                    interrupt_received = 1;
+                    printf("\n");
+                    fflush(stdout);
+                    printed = 1;
+                    break;
+            }
+        }
+    }
+
+    // Jobs watched by a pidfd are reported through their own event, the others are checked here
+    if (received_SIGCHLD) {
+        for (job = job_list; job != NULL; job = next) {
+            next = job->next;
+            if (job->pidfd == -1) {
+                printed += reap_background_job(job);
+            }
+        }
+    }
+    return printed > 0;
+}
+
+/*
+    Function that picks how the command reader reads stdin and allocates its buffer
+*/
+void init_input(void) {
+    struct stat input_info;
+    input_capacity = INPUT_BUFFER_SIZE;
+    input_buffer = malloc(input_capacity);
+    if (input_buffer == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    if (fstat(STDIN_FILENO, &input_info) == 0 && S_ISFIFO(input_info.st_mode) && pipe2(peek_pipe, O_CLOEXEC) == 0) {
+        peek_pipe[0] = move_shell_fd(peek_pipe[0]);
+        peek_pipe[1] = move_shell_fd(peek_pipe[1]);
+        fcntl(peek_pipe[1], F_SETPIPE_SZ, INPUT_BUFFER_SIZE);
+        null_fd = move_shell_fd(open("/dev/null", O_WRONLY | O_CLOEXEC));
+        input_mode = INPUT_PEEK;
+    }
+    else if (isatty(STDIN_FILENO) || (fstat(STDIN_FILENO, &input_info) == 0 && S_ISREG(input_info.st_mode))) {
+        input_mode = INPUT_BLOCK;
+    }
+    else {
+        input_mode = INPUT_BYTE;
+    }
+}
+
+/*
+    Function that takes the peeked bytes of the buffer up to position end out of the stdin pipe.
+    The buffer already has them, so they are spliced to /dev/null, or read into a scratch buffer
+    where that is not supported
+*/
+void take_peeked(size_t end) {
+    char scratch[4096];
+    size_t first = input_end - input_peeked;
+    ssize_t bytes;
+    while (first < end) {
+        bytes = splice(STDIN_FILENO, NULL, null_fd, NULL, end - first, 0);
+        if (bytes == -1) {
+            bytes = read(STDIN_FILENO, scratch, end - first < sizeof(scratch) ? end - first : sizeof(scratch));
+        }
+        if (bytes <= 0) {
+            // Someone else emptied the pipe, so the peeked bytes are all there is
+            break;
+        }
+        first += bytes;
+    }
+    input_peeked = input_end - end;
+}
+
+/*
+    Function that is called before a child that may read stdin is started. Whatever the reader
+    read ahead is given back: the file offset is moved back to the first unused byte, or the used
+    lines are taken out of the pipe and the rest is left there
+*/
+void sync_input(void) {
+    if (input_mode == INPUT_PEEK && input_peeked > 0) {
+        take_peeked(input_start);
+        input_end = input_start;
+        input_peeked = 0;
+    }
+    else if (input_mode == INPUT_BLOCK && input_start < input_end &&
+             lseek(STDIN_FILENO, -(off_t)(input_end - input_start), SEEK_CUR) != -1) {
+        input_end = input_start;
+    }
+}
+
+/*
+    Function that adds more of stdin to the buffer. Returns the number of bytes added, 0 at the end
+    of the input and -1 on an error
+*/
+ssize_t fill_input(void) {
+    ssize_t bytes, copied, result;
+    size_t space;
+
+    // Before more of the pipe is peeked at, everything in the buffer is taken out of it: the lines
+    // returned so far and the partial line, which is needed anyway
+    if (input_mode == INPUT_PEEK) {
+        take_peeked(input_end);
+    }
+
+    // The unused bytes are moved to the front, and the buffer grows for lines longer than it
+    if (input_start > 0) {
+        memmove(input_buffer, input_buffer + input_start, input_end - input_start);
+        input_end -= input_start;
+        input_start = 0;
+    }
+    if (input_end + 1 >= input_capacity) {
+        input_capacity *= 2;
+        input_buffer = realloc(input_buffer, input_capacity);
+        if (input_buffer == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    space = input_capacity - input_end - 1;
+
+    switch (input_mode) {
+        case INPUT_PEEK:
+            bytes = tee(STDIN_FILENO, peek_pipe[1], space, 0);
+            if (bytes == -1 && errno == EINVAL) {
+                input_mode = INPUT_BYTE;
+                return fill_input();
+            }
+            for (copied = 0; copied < bytes; copied += result) {
+                result = read(peek_pipe[0], input_buffer + input_end + copied, bytes - copied);
+                if (result <= 0) {
+                    perror("read");
+                    exit(1);
+                }
+            }
+            if (bytes > 0) {
+                input_peeked = bytes;
+            }
+            break;
+        case INPUT_BYTE:
+            bytes = read(STDIN_FILENO, input_buffer + input_end, 1);
+            break;
+        default:
+            bytes = read(STDIN_FILENO, input_buffer + input_end, space);
+            break;
+    }
+    if (bytes > 0) {
+        input_end += bytes;
+    }
+    return bytes;
+}
+
+/*
+    Function that returns the next line of stdin with its newline replaced by a '\0'. The line
+    stays in the reader's buffer and is valid until the next line is read. Returns NULL at the end
+    of the input
+*/
+char* read_input_line(void) {
+    char *newline, *line;
+    size_t searched = 0;
+
+    while ((newline = memchr(input_buffer + input_start + searched, '\n', input_end - input_start - searched)) == NULL) {
+        searched = input_end - input_start;
+        if (fill_input() <= 0) {
+            if (input_start == input_end) {
+                return NULL;
+            }
+            // The last line has no newline
+            input_buffer[input_end] = '\0';
+            line = input_buffer + input_start;
+            input_start = input_end;
+            return line;
+        }
+    }
+    *newline = '\0';
+    line = input_buffer + input_start;
+    input_start = newline + 1 - input_buffer;
+    return line;
+}
+
+/*
+    Function that checks whether the command reader already holds unread input, in which case
+    epoll might not report it
+*/
+int stdin_buffered(void) {
+    return input_start < input_end;
+}
+
+/*
+    Function that runs the event loop. Background jobs are reported as soon as their pidfd becomes
+    readable and pending signals are handled from the signalfd. With EVENTS_PENDING it only handles
+    what is already pending, with EVENTS_ONCE it blocks until at least one job or signal event has
+    been handled, and with EVENTS_INPUT it blocks until a command can be read
+*/
+void run_event_loop(int mode) {
+    struct epoll_event events[16];
+    struct epoll_event stdin_event = { 0 };
+    int i, ready, timeout;
+
+    // While only waiting for jobs, stdin is taken out of the epoll set so pending input (or a hang
+    // up, which is always reported) does not make the wait spin
+    if (mode == EVENTS_ONCE && stdin_watched) {
+        epoll_ctl(event_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+    }
+
+    while (1) {
+        int input_ready = 0;
+        int jobs_reported = 0;
+        int handled = 0;
+        timeout = -1;
+        if (mode == EVENTS_PENDING || (mode == EVENTS_INPUT && (!stdin_watched || stdin_buffered()))) {
+            timeout = 0;
+        }
+        ready = epoll_wait(event_fd, events, 16, timeout);
+        if (ready == -1) {
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (i = 0; i < ready; i++) {
+            if (events[i].data.ptr == NULL) {
+                input_ready = 1;
+            }
+            else if (events[i].data.ptr == &signal_fd) {
+                jobs_reported += handle_signals();
+                handled = 1;
+            }
+            else {
+                jobs_reported += reap_background_job(events[i].data.ptr);
+                handled = 1;
+            }
+        }
+        if (mode == EVENTS_PENDING) {
+            // Keep draining until fewer events than the buffer holds are pending
+            if (ready < 16) {
+                return;
+            }
+        }
+        else if (mode == EVENTS_ONCE) {
+            if (handled) {
+                if (stdin_watched) {
+                    stdin_event.events = EPOLLIN;
+                    epoll_ctl(event_fd, EPOLL_CTL_ADD, STDIN_FILENO, &stdin_event);
+                }
+                return;
+            }
+        }
+        else if (input_ready || timeout == 0) {
+            return;
+        }
+        else if (jobs_reported > 0 && interactive) {
+            // The prompt is shown again after job reports and signal messages
+            printf(": ");
+            fflush(stdout);
+        }
+    }
+}
+
+/*
+    Function that parses a CPU or node list such as "0-3,8,10-11" into a CPU set. Returns -1 if the
+    list is malformed
+*/
+int parse_cpu_list(char* list, cpu_set_t* set) {
+    char* end;
+    long first, last;
+    CPU_ZERO(set);
+    while (*list != '\0' && *list != '\n') {
+        first = strtol(list, &end, 10);
+        if (end == list || first < 0) {
+            return -1;
+        }
+        last = first;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first) {
+                return -1;
+            }
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, set);
+        }
+        list = end;
+        if (*list == ',') {
+            list++;
+        }
+        else if (*list != '\0' && *list != '\n') {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Function that reads a CPU or node list from a sysfs file into a set. Returns -1 on failure
+*/
+int read_cpu_list(char* path, cpu_set_t* set) {
+    char buffer[4096];
+    ssize_t length;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length < 0) {
+        return -1;
+    }
+    buffer[length] = '\0';
+    return parse_cpu_list(buffer, set);
+}
+
+/*
+    Function that returns the member of a set that follows after in round-robin order, or -1 if the
+    set is empty
+*/
+int next_in_set(cpu_set_t* set, int after) {
+    int i, candidate;
+    for (i = 1; i <= CPU_SETSIZE; i++) {
+        candidate = (after + i) % CPU_SETSIZE;
+        if (candidate >= 0 && CPU_ISSET(candidate, set)) {
+            return candidate;
+        }
+    }
+    return -1;
+}
+
+/*
+    Function that gives the shell the CPU affinity and memory policy a job asked for, so that the
+    job's processes inherit them from posix_spawn or fork. Explicit @cpus and @node settings are
+    used first, otherwise background jobs are placed round-robin when automatic placement is on.
+    The shell's own settings are saved for restore_placement. Returns -1 on a bad setting
+*/
+int apply_placement(struct job_options* options, int background, struct saved_placement* saved) {
+    cpu_set_t cpus;
+    char path[128];
+    int node = options->node;
+    int has_cpus = 0;
+    unsigned long node_mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = { 0 };
+
+    saved->changed_cpus = 0;
+    saved->changed_memory = 0;
+    sched_getaffinity(0, sizeof(cpu_set_t), &saved->cpus);
+
+    if (options->cpus != NULL) {
+        if (parse_cpu_list(options->cpus, &cpus) == -1) {
+            printf("%s: invalid CPU list\n", options->cpus);
+            fflush(stdout);
+            return -1;
+        }
+        has_cpus = 1;
+    }
+    else if (node == -1 && background && placement_mode == PLACEMENT_CPU) {
+        // The next CPU the shell itself may run on
+        placement_last = next_in_set(&saved->cpus, placement_last);
+        CPU_ZERO(&cpus);
+        CPU_SET(placement_last, &cpus);
+        has_cpus = 1;
+    }
+    else if (node == -1 && background && placement_mode == PLACEMENT_NODE) {
+        if (read_cpu_list("/sys/devices/system/node/online", &cpus) == 0) {
+            node = placement_last = next_in_set(&cpus, placement_last);
+        }
+    }
+
+    // A node places the job on that node's CPUs unless CPUs were given, and binds its memory there
+    if (node != -1) {
+        if (node < 0 || node >= MAX_NUMA_NODES) {
+            printf("%d: invalid NUMA node\n", node);
+            fflush(stdout);
+            return -1;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (!has_cpus) {
+            if (read_cpu_list(path, &cpus) == -1) {
+                printf("%d: invalid NUMA node\n", node);
+                fflush(stdout);
+                return -1;
+            }
+            has_cpus = 1;
+        }
+        if (syscall(SYS_get_mempolicy, &saved->mode, saved->nodes, MAX_NUMA_NODES, NULL, 0) == 0) {
+            node_mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+            if (syscall(SYS_set_mempolicy, MPOL_BIND, node_mask, MAX_NUMA_NODES) == 0) {
+                saved->changed_memory = 1;
+            }
+            else {
+                perror("set_mempolicy");
+            }
+        }
+    }
+
+    if (has_cpus) {
+        if (sched_setaffinity(0, sizeof(cpu_set_t), &cpus) == 0) {
+            saved->changed_cpus = 1;
+        }
+        else {
+            perror("sched_setaffinity");
+        }
+    }
+    return 0;
+}
+
+/*
+    Function that gives the shell back the CPU affinity and memory policy saved by apply_placement
+*/
+void restore_placement(struct saved_placement* saved) {
+    if (saved->changed_cpus) {
+        sched_setaffinity(0, sizeof(cpu_set_t), &saved->cpus);
+    }
+    if (saved->changed_memory) {
+        if (saved->mode == MPOL_DEFAULT) {
+            syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+        }
+        else {
+            syscall(SYS_set_mempolicy, saved->mode, saved->nodes, MAX_NUMA_NODES);
+        }
+    }
+}
+
+/*
+    Function that implements the 'placement' builtin, which shows or sets the automatic placement
+    of background jobs: 'off', 'cpu' (round-robin over CPUs) or 'node' (round-robin over NUMA nodes)
+*/
+void placement_builtin(char** command_line) {
+    char* names[] = { "off", "cpu", "node" };
+    int i;
+    if (command_line[1] == NULL) {
+        printf("%s\n", names[placement_mode]);
+        fflush(stdout);
+        return;
+    }
+    for (i = 0; i < 3; i++) {
+        if (strcmp(command_line[1], names[i]) == 0) {
+            placement_mode = i;
+            placement_last = -1;
+            return;
+        }
+    }
+    printf("placement: usage: placement [off | cpu | node]\n");
+    fflush(stdout);
+}
+
+/*
+    Function that writes all length bytes of data to fd. Returns -1 on an error
+*/
+int write_all(int fd, char* data, size_t length) {
+    ssize_t written;
+    while (length > 0) {
+        written = write(fd, data, length);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/*
+    Function that moves length bytes from the pipe from_fd to to_fd with splice, or with read and
+    write for an fd splice does not support. Returns -1 on an error
+*/
+int move_all(int from_fd, int to_fd, size_t length) {
+    char buffer[16384];
+    ssize_t bytes;
+    while (length > 0) {
+        bytes = splice(from_fd, NULL, to_fd, NULL, length, SPLICE_F_MOVE);
+        if (bytes == -1 && errno == EINVAL) {
+            bytes = read(from_fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer));
+            if (bytes > 0 && write_all(to_fd, buffer, bytes) == -1) {
+                return -1;
+            }
+        }
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (bytes == 0) {
+            errno = EPIPE;
+            return -1;
+        }
+        length -= bytes;
+    }
+    return 0;
+}
+
+/*
+    Function that returns whether a pipeline stage is the 'tee [-a] [FILE...]' builtin. Other
+    options are left to the real program
+*/
+int tee_builtin_applies(struct stage* stage) {
+    int i;
+    if (strcmp(stage->argv[0], "tee") != 0) {
+        return 0;
+    }
+    for (i = 1; stage->argv[i] != NULL; i++) {
+        if (stage->argv[i][0] == '-' && strcmp(stage->argv[i], "-a") != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+    Function that implements the 'tee [-a] [FILE...]' builtin in the child of a pipeline stage,
+    copying stdin to stdout and to each file, appending with -a. When stdin is a pipe the data never
+    passes through the process: each chunk is duplicated with tee(2) into a scratch pipe as large
+    as stdin's and spliced from there into each file in turn, and at last spliced from stdin itself
+    into stdout. Otherwise it is read into a buffer and written to all of them. Returns the exit
+    value
+*/
+int tee_builtin(char** argv) {
+    struct stat input_info;
+    int append = 0, status = 0, file_count = 0;
+    int scratch[2] = { -1, -1 };
+    int* files;
+    char* buffer;
+    ssize_t bytes;
+    int i, size;
+
+    for (i = 1; argv[i] != NULL; i++) {
+        if (strcmp(argv[i], "-a") == 0) {
+            append = 1;
+        }
+    }
+    files = arena_alloc(i * sizeof(int));
+    for (i = 1; argv[i] != NULL; i++) {
+        if (strcmp(argv[i], "-a") == 0) {
+            continue;
+        }
+        // splice cannot write to an O_APPEND file, but move_all then copies through a buffer, and
+        // only O_APPEND keeps the writes of other appenders to the same file
+        files[file_count] = openat(cwd_fd, argv[i], O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC) | O_CLOEXEC, 0666);
+        if (files[file_count] == -1) {
+            dprintf(STDERR_FILENO, "tee: %s: %s\n", argv[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        file_count++;
+    }
+
+    if (file_count > 0 && fstat(STDIN_FILENO, &input_info) == 0 && S_ISFIFO(input_info.st_mode) &&
+        (size = fcntl(STDIN_FILENO, F_GETPIPE_SZ)) > 0 && pipe2(scratch, O_CLOEXEC) == 0 &&
+        fcntl(scratch[1], F_SETPIPE_SZ, size) >= size) {
+        while (1) {
+            // The scratch pipe is empty and can take all of stdin, so tee duplicates a whole chunk
+            bytes = tee(STDIN_FILENO, scratch[1], COPY_CHUNK, 0);
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            if (bytes <= 0) {
+                break;
+            }
+            for (i = 0; i < file_count && bytes > 0; i++) {
+                if (i > 0) {
+                    bytes = tee(STDIN_FILENO, scratch[1], bytes, 0);
+                }
+                if (bytes == -1 || move_all(scratch[0], files[i], bytes) == -1) {
+                    bytes = -1;
+                }
+            }
+            if (bytes == -1 || move_all(STDIN_FILENO, STDOUT_FILENO, bytes) == -1) {
+                bytes = -1;
+                break;
+            }
+        }
+    }
+    else {
+        buffer = malloc(COPY_BUFFER_SIZE);
+        if (buffer == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        while ((bytes = read(STDIN_FILENO, buffer, COPY_BUFFER_SIZE)) != 0) {
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            if (bytes == -1 || write_all(STDOUT_FILENO, buffer, bytes) == -1) {
+                bytes = -1;
+                break;
+            }
+            for (i = 0; i < file_count && bytes != -1; i++) {
+                if (write_all(files[i], buffer, bytes) == -1) {
+                    bytes = -1;
+                }
+            }
+            if (bytes == -1) {
+                break;
+            }
+        }
+        free(buffer);
+    }
+    if (bytes == -1) {
+        perror("tee");
+        status = 1;
+    }
+    return status;
+}
+
+/*
+    Function that forks a child directly into the cgroup open as cgroup_fd. clone3() with
+    CLONE_INTO_CGROUP is used where the kernel supports it, otherwise the child moves itself
+    through cgroup.procs after a plain fork()
+*/
+pid_t fork_into_cgroup(int cgroup_fd) {
+    pid_t spawnPid = -1;
+    int procs;
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+    struct clone_args args = { 0 };
+    args.flags = CLONE_INTO_CGROUP;
+    args.exit_signal = SIGCHLD;
+    args.cgroup = cgroup_fd;
+    spawnPid = syscall(SYS_clone3, &args, sizeof(args));
+    if (spawnPid != -1) {
+        return spawnPid;
+    }
+#endif
+    spawnPid = fork();
+    if (spawnPid == 0) {
+        procs = openat(cgroup_fd, "cgroup.procs", O_WRONLY);
+        if (procs == -1 || write(procs, "0", 1) != 1) {
+            perror("cgroup.procs");
+        }
+        close(procs);
+    }
+    return spawnPid;
+}
+
+/*
+    Function that closes the fds above stderr that are close-on-exec, as exec would, in a child that
+    runs a builtin stage instead of a program. Otherwise the child would keep the shell's epoll fd,
+    signalfd and pidfds and the read ends of pipes it writes to, so it would never see EPIPE
+*/
+void close_exec_fds(void) {
+    struct dirent* entry;
+    DIR* directory = opendir("/proc/self/fd");
+    long fd, limit;
+
+    if (directory == NULL) {
+        limit = sysconf(_SC_OPEN_MAX);
+        for (fd = 3; fd < limit; fd++) {
+            if (fcntl(fd, F_GETFD) > 0) {
+                close(fd);
+            }
+        }
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL) {
+        fd = strtol(entry->d_name, NULL, 10);
+        if (fd > 2 && fd != dirfd(directory) && fcntl(fd, F_GETFD) > 0) {
+            close(fd);
+        }
+    }
+    closedir(directory);
+}
+
+/*
+    Function that runs a pipeline stage in a child created with fork(). It is used when the job runs
+    in its own cgroup (cgroup_fd is not -1) and as a fallback when posix_spawn cannot start the
+    command, and it reports redirection and exec errors from the child. Returns -1 if no child can
+    be created, which leaves the shell running
+*/
+pid_t fork_command(struct stage* stage, int in_fd, int out_fd, int* redirect_fds, pid_t pgid, int cgroup_fd) {
+    struct redirection* redirection;
+    sigset_t empty_mask;
+    int i;
+    pid_t spawnPid = cgroup_fd != -1 ? fork_into_cgroup(cgroup_fd) : fork();
+    switch (spawnPid) {
+        case -1:
+            // If the fork fails, an error is displayed and the caller gives up on the pipeline
+            perror("fork() failed!\n");
+            break;
+        case 0:
+            // The fork is successful and the program continues. The signals the shell reads from its
+            // signalfd are unblocked, and background pipelines leave the terminal's process group
+            // so that SIGINT from the keyboard does not reach them
+            sigemptyset(&empty_mask);
+            sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+            if (pgid != -1) {
+                setpgid(0, pgid);
+            }
+            // The pipes to the neighbouring stages become stdin and stdout, then the stage's
+            // redirections are applied in order with the files the shell opened for them
+            if ((in_fd != -1 && dup2(in_fd, 0) == -1) || (out_fd != -1 && dup2(out_fd, 1) == -1)) {
+                perror("dup2");
+                _exit(1);
+            }
+            for (i = 0; i < stage->redirection_count; i++) {
+                redirection = &stage->redirections[i];
+                if (redirection->type == REDIRECT_CLOSE) {
+                    close(redirection->fd);
+                }
+                else if (dup2(redirection->type == REDIRECT_DUP ? redirection->source : redirect_fds[i], redirection->fd) == -1) {
+                    perror("dup2");
+                    _exit(1);
+                }
+            }
+            // Builtin stages run in the child without a program
+            if (tee_builtin_applies(stage)) {
+                // cwd_fd is closed with the rest, but the child's working directory is the shell's
+                close_exec_fds();
+                cwd_fd = AT_FDCWD;
+                _exit(tee_builtin(stage->argv));
+            }
+            if (execvp(stage->argv[0], stage->argv) < 0) {
+                // If an invalid command is entered an error message is displayed
+                printf("%s is an invalid command\n", stage->argv[0]);
+                fflush(stdout);
+                _exit(1);
+            }
+            break;
+    }
+    return spawnPid;
+}
+
+/*
+    Function that launches a pipeline stage with posix_spawn. The stdin and stdout fds become
+    spawn file actions and the signal setup becomes spawn attributes, so the shell's page tables
+    are never copied. The program is found through the command hash table. in_fd and out_fd are
+    the pipes to the neighbouring stages (-1 if none), redirect_fds the files opened for the stage's
+    redirections and pgid is the process group to join, 0 for a new one or -1 to stay in the
+    shell's. If the command is not found or the spawn fails (bad fd, no resources) it is retried
+    through fork_command so the user gets the usual error. Jobs that run in their own cgroup always
+    go through fork_command, which can clone into it, and so do builtin stages
+*/
+pid_t launch_command(struct stage* stage, int in_fd, int out_fd, int* redirect_fds, pid_t pgid, int cgroup_fd) {
+    posix_spawn_file_actions_t file_actions;
+    struct redirection* redirection;
+    posix_spawnattr_t attributes;
+    sigset_t default_signals, empty_mask;
+    char* program = lookup_command(stage->argv[0]);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    pid_t spawnPid = -1;
+    int result = 0;
+    int i;
+
+    if (program == NULL || cgroup_fd != -1 || tee_builtin_applies(stage)) {
+        return fork_command(stage, in_fd, out_fd, redirect_fds, pgid, cgroup_fd);
+    }
+
+    // The pipes are applied first so the stage's own redirections override them
+    posix_spawn_file_actions_init(&file_actions);
+    if (in_fd != -1) {
+        posix_spawn_file_actions_adddup2(&file_actions, in_fd, 0);
+    }
+    if (out_fd != -1) {
+        posix_spawn_file_actions_adddup2(&file_actions, out_fd, 1);
+    }
+    for (i = 0; i < stage->redirection_count && result == 0; i++) {
+        redirection = &stage->redirections[i];
+        if (redirection->type == REDIRECT_CLOSE) {
+            result = posix_spawn_file_actions_addclose(&file_actions, redirection->fd);
+        }
+        else {
+            result = posix_spawn_file_actions_adddup2(&file_actions,
+                redirection->type == REDIRECT_DUP ? redirection->source : redirect_fds[i], redirection->fd);
+        }
+    }
+
+    // The child gets the default signal actions with nothing blocked. Background pipelines are put
+    // in their own process group so SIGINT from the keyboard does not reach them
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGINT);
+    sigaddset(&default_signals, SIGTSTP);
+    sigemptyset(&empty_mask);
+    if (pgid != -1) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_init(&attributes);
+#ifdef POSIX_SPAWN_USEVFORK
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif
+    posix_spawnattr_setflags(&attributes, flags);
+    posix_spawnattr_setsigdefault(&attributes, &default_signals);
+    posix_spawnattr_setsigmask(&attributes, &empty_mask);
+    posix_spawnattr_setpgroup(&attributes, pgid == -1 ? 0 : pgid);
+
+    if (result == 0) {
+        result = posix_spawn(&spawnPid, program, &file_actions, &attributes, stage->argv, environ);
+    }
+
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&file_actions);
+
+    // If the spawn did not succeed, fall back to fork() and exec
+    if (result != 0) {
+        spawnPid = fork_command(stage, in_fd, out_fd, redirect_fds, pgid, -1);
+    }
+    return spawnPid;
+}
+
+/*
+    Function that changes the shell's working directory and reopens cwd_fd for it. If the directory
+    cannot be opened, redirections fall back to the path lookup of the working directory
+*/
+int chdir_shell(char* path) {
+    if (path == NULL || chdir(path) == -1) {
+        return -1;
+    }
+    if (cwd_fd != AT_FDCWD) {
+        close(cwd_fd);
+    }
+    cwd_fd = move_shell_fd(open(".", O_PATH | O_DIRECTORY | O_CLOEXEC));
+    if (cwd_fd == -1) {
+        cwd_fd = AT_FDCWD;
+    }
+    return 0;
+}
+
+/*
+    Function that returns an fd to read text from, followed by a newline if newline is set, for a
+    here-document or here-string. Small texts are written into a pipe, larger ones into a memfd
+    that is sealed against changes and rewound. Returns -1 if neither can be created
+*/
+int open_here_document(char* text, int newline) {
+    size_t length = strlen(text);
+    struct iovec parts[2] = { { text, length }, { "\n", newline } };
+    int pipe_fds[2];
+    int fd, i;
+
+    if (length + newline <= HERE_DOC_PIPE_MAX && pipe2(pipe_fds, O_CLOEXEC) == 0) {
+        if (writev(pipe_fds[1], parts, 2) != (ssize_t)(length + newline)) {
+            perror("here-document");
+        }
+        close(pipe_fds[1]);
+        return pipe_fds[0];
+    }
+    fd = memfd_create("here-document", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        perror("memfd_create");
+        return -1;
+    }
+    while (parts[0].iov_len + parts[1].iov_len > 0) {
+        ssize_t written = writev(fd, parts, 2);
+        if (written == -1) {
+            perror("here-document");
+            close(fd);
+            return -1;
+        }
+        // The parts are advanced past what was written
+        for (i = 0; i < 2; i++) {
+            size_t taken = (size_t)written < parts[i].iov_len ? (size_t)written : parts[i].iov_len;
+            parts[i].iov_base = (char*)parts[i].iov_base + taken;
+            parts[i].iov_len -= taken;
+            written -= taken;
+        }
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/*
+    Function that opens the target of a redirection of the given type relative to the shell's
+    working directory, or the text of a here-document or here-string. The fd is close-on-exec so
+    only the child it is handed to keeps it. If the file cannot be opened an error message is
+    displayed and -1 returned
+*/
+int open_redirection(char* path, int type) {
+    int fd;
+    if (type == REDIRECT_HERE_DOC || type == REDIRECT_HERE_STRING) {
+        return open_here_document(path, type == REDIRECT_HERE_STRING);
+    }
+    fd = openat(cwd_fd, path, redirect_flags[type] | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        if (type == REDIRECT_INPUT) {
+            printf("%s: no such file or directory\n", path);
+        }
+        else {
+            printf("cannot open %s\n", path);
+        }
+        fflush(stdout);
+    }
+    return fd;
+}
+
+/*
+    Function that returns whether the source of the 'N>&M' redirection at index of a stage is an fd
+    the child will have: one an earlier redirection of the stage set up, or one the shell was given
+    open. The shell's own fds are close-on-exec, so a source among them is refused, unless it is at
+    SHELL_FD_MIN or above, where only the shell's own redirections can name it
+*/
+int dup_source_open(struct stage* stage, int index) {
+    int source = stage->redirections[index].source;
+    while (--index >= 0) {
+        if (stage->redirections[index].fd == source) {
+            return stage->redirections[index].type != REDIRECT_CLOSE;
+        }
+    }
+    return source >= SHELL_FD_MIN || fcntl(source, F_GETFD) == 0;
+}
+
+/*
+    Function that opens the redirection targets of all stages of a pipeline before any of them
+    starts, so a bad file name costs no child. fds gets the fd opened for each redirection, -1 for
+    those without a target. A stage that names fds of its own gets its files above them, so that
+    applying one redirection cannot overwrite the file of a later one. Returns -1, with the files
+    opened so far closed, if one cannot be opened or an 'N>&M' names an fd that is not open
+*/
+int open_redirections(struct stage* stages, int stage_count, int* fds) {
+    struct redirection* redirection;
+    int count = 0;
+    int highest, moved;
+    int i, j;
+
+    for (i = 0; i < stage_count; i++) {
+        highest = 2;
+        for (j = 0; j < stages[i].redirection_count; j++) {
+            redirection = &stages[i].redirections[j];
+            highest = redirection->fd > highest ? redirection->fd : highest;
+            highest = redirection->source > highest ? redirection->source : highest;
+        }
+        for (j = 0; j < stages[i].redirection_count; j++, count++) {
+            redirection = &stages[i].redirections[j];
+            fds[count] = -1;
+            if (redirection->type == REDIRECT_DUP && !dup_source_open(&stages[i], j)) {
+                printf("%i: bad file descriptor\n", redirection->source);
+                fflush(stdout);
+            }
+            else if (redirection->target == NULL) {
+                continue;
+            }
+            else {
+                fds[count] = open_redirection(redirection->target, redirection->type);
+            }
+            if (fds[count] == -1) {
+                while (count-- > 0) {
+                    if (fds[count] != -1) {
+                        close(fds[count]);
+                    }
+                }
+                return -1;
+            }
+            if (fds[count] <= highest && (moved = fcntl(fds[count], F_DUPFD_CLOEXEC, highest + 1)) != -1) {
+                close(fds[count]);
+                fds[count] = moved;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+    Function that launches all stages of a pipeline, connecting neighbouring stages with pipe2()
+    pipes. A background pipeline gets its own process group led by the first stage, a foreground
+    one stays in the shell's group so the terminal's signals reach every stage. All stages are put in
+    the cgroup open as cgroup_fd, if it is not -1. The pids are stored in pids and the number of
+    stages started is returned. If a redirection cannot be opened no stage is started, and if a
+    stage cannot be started the ones after it are not either. Either way the exit value becomes 1
+*/
+int launch_pipeline(struct stage* stages, int stage_count, int background_mode_flag, int cgroup_fd, pid_t* pids) {
+    pid_t pgid = background_mode_flag == 1 ? 0 : -1;
+    int* redirect_fds;
+    int redirect_count = 0;
+    int in_fd = -1;
+    int i, j, first;
+
+    for (i = 0; i < stage_count; i++) {
+        redirect_count += stages[i].redirection_count;
+    }
+    redirect_fds = arena_alloc(redirect_count * sizeof(int));
+    if (open_redirections(stages, stage_count, redirect_fds) == -1) {
+        child_exit_status = 1 << 8;
+        return 0;
+    }
+
+    // The stages may read the shell's stdin, so the command reader gives back what it read ahead
+    sync_input();
+
+    first = 0;
+    for (i = 0; i < stage_count; i++) {
+        int pipe_fds[2] = { -1, -1 };
+        if (i < stage_count - 1) {
+            if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+                perror("pipe2");
+                break;
+            }
+            // Pipes for high-throughput stages can be made larger than the kernel default
+            if (pipe_size > 0 && fcntl(pipe_fds[1], F_SETPIPE_SZ, pipe_size) == -1) {
+                perror("F_SETPIPE_SZ");
+            }
+        }
+        pids[i] = launch_command(&stages[i], in_fd, pipe_fds[1], redirect_fds + first, pgid, cgroup_fd);
+        if (pids[i] == -1 && pipe_fds[0] != -1) {
+            // The stages before see the pipe to this one closed
+            close(pipe_fds[0]);
+            pipe_fds[0] = -1;
+        }
+        if (pgid == 0) {
+            pgid = pids[i];
+        }
+
+        // The parent's copies of the pipe ends and files are closed once the stages using them
+        // are started
+        if (in_fd != -1) {
+            close(in_fd);
+        }
+        if (pipe_fds[1] != -1) {
+            close(pipe_fds[1]);
+        }
+        for (j = 0; j < stages[i].redirection_count; j++, first++) {
+            if (redirect_fds[first] != -1) {
+                close(redirect_fds[first]);
+            }
+        }
+        in_fd = pipe_fds[0];
+        if (pids[i] == -1) {
+            break;
+        }
+    }
+    // The files of stages not started after a failed pipe2() or launch are closed as well
+    for (; first < redirect_count; first++) {
+        if (redirect_fds[first] != -1) {
+            close(redirect_fds[first]);
+        }
+    }
+    if (i < stage_count) {
+        child_exit_status = 1 << 8;
+    }
+    return i;
+}
+
+/*
+    Function that implements the 'pipesize' builtin: with no argument the pipe capacity used for
+    pipelines is shown, otherwise it is set in bytes (0 keeps the kernel default)
+*/
+void pipesize_builtin(char** command_line) {
+    if (command_line[1] == NULL) {
+        if (pipe_size > 0) {
+            printf("%d\n", pipe_size);
+        }
+        else {
+            printf("default\n");
+        }
+    }
+    else {
+        pipe_size = atoi(command_line[1]);
+    }
+    fflush(stdout);
+}
+
+/*
+    Function that appends a word to a command. When the words array is full it is copied to one
+    twice as large in the arena
+*/
+void add_word(struct command* command, char* word) {
+    char** words;
+    if (command->word_count == command->word_capacity) {
+        words = arena_alloc(2 * command->word_capacity * sizeof(char*));
+        memcpy(words, command->words, command->word_count * sizeof(char*));
+        command->words = words;
+        command->word_capacity *= 2;
+    }
+    command->words[command->word_count++] = word;
+}
+
+/*
+    Function that starts the next stage of a command, growing the stages array like add_word
+*/
+void add_stage(struct command* command) {
+    struct stage* stages;
+    if (command->stage_count == command->stage_capacity) {
+        stages = arena_alloc(2 * command->stage_capacity * sizeof(struct stage));
+        memcpy(stages, command->stages, command->stage_count * sizeof(struct stage));
+        command->stages = stages;
+        command->stage_capacity *= 2;
+    }
+    command->stages[command->stage_count].argv = NULL;
+    command->stages[command->stage_count].redirections = NULL;
+    command->stages[command->stage_count].redirection_count = 0;
+    command->stage_count++;
+}
+
+/*
+    Function that adds a redirection to the last stage of a command, growing the redirections array
+    like add_word
+*/
+void add_redirection(struct command* command, int type, int fd, int source, char* target) {
+    struct redirection* redirections;
+    if (command->redirection_count == command->redirection_capacity) {
+        redirections = arena_alloc(2 * command->redirection_capacity * sizeof(struct redirection));
+        memcpy(redirections, command->redirections, command->redirection_count * sizeof(struct redirection));
+        command->redirections = redirections;
+        command->redirection_capacity *= 2;
+    }
+    command->redirections[command->redirection_count].type = type;
+    command->redirections[command->redirection_count].fd = fd;
+    command->redirections[command->redirection_count].source = source;
+    command->redirections[command->redirection_count].target = target;
+    command->redirection_count++;
+    command->stages[command->stage_count - 1].redirection_count++;
+}
+
+/*
+    Function that records a slot of a command that needs expanding, growing the array like add_word
+*/
+void add_expansion(struct command* command, int slot) {
+    int* expansions;
+    if (command->expansion_count == command->expansion_capacity) {
+        expansions = arena_alloc(2 * command->expansion_capacity * sizeof(int));
+        memcpy(expansions, command->expansions, command->expansion_count * sizeof(int));
+        command->expansions = expansions;
+        command->expansion_capacity *= 2;
+    }
+    command->expansions[command->expansion_count++] = slot;
+}
+
+/*
+    Function that empties a command, making it use its inline storage again
+*/
+void clear_command(struct command* command) {
+    command->words = command->inline_words;
+    command->word_count = 0;
+    command->word_capacity = INLINE_WORDS;
+    command->stages = command->inline_stages;
+    command->stage_count = 0;
+    command->stage_capacity = INLINE_STAGES;
+    command->redirections = command->inline_redirections;
+    command->redirection_count = 0;
+    command->redirection_capacity = INLINE_REDIRECTIONS;
+    command->expansions = command->inline_expansions;
+    command->expansion_count = 0;
+    command->expansion_capacity = INLINE_EXPANSIONS;
+}
+
+/*
+    Function that points each stage of a command at its part of the command's redirections, once
+    the array no longer moves
+*/
+void attach_redirections(struct command* command) {
+    struct redirection* redirection = command->redirections;
+    int i;
+    for (i = 0; i < command->stage_count; i++) {
+        command->stages[i].redirections = redirection;
+        redirection += command->stages[i].redirection_count;
+    }
+}
+
+/*
+    Function that finds the parenthesis closing the one before text, skipping over nested ones,
+    quotes and backslash escapes. Returns NULL if the line ends first
+*/
+char* find_closing(char* text) {
+    int depth = 1;
+    for (; *text != '\0' && *text != '\n'; text++) {
+        if (*text == '(') {
+            depth++;
+        }
+        else if (*text == ')' && --depth == 0) {
+            return text;
+        }
+        else if (*text == '\\' && text[1] != '\0') {
+            text++;
+        }
+        else if ((*text == '\'' || *text == '"') && (text = strchr(text + 1, *text)) == NULL) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Function that copies the '(command)' of a $(command) from *read to *write for the lexer, as it
+    is, because it is only lexed when it runs. Returns -1 for a syntax error
+*/
+int copy_command_text(char** read, char** write) {
+    char* end = find_closing(*read + 1);
+    if (end == NULL) {
+        printf("syntax error: unterminated $(\n");
+        fflush(stdout);
+        return -1;
+    }
+    memmove(*write, *read, end + 1 - *read);
+    *write += end + 1 - *read;
+    *read = end + 1;
+    return 0;
+}
+
+/*
+    Function that returns the fd number a redirection operator starts with: the digits of the
+    unquoted word right before it, or -2 for '&' before '>', which redirects stdout and stderr.
+    Returns -1 if the word is an ordinary argument
+*/
+int redirection_fd(char* word, int quoted, char operator) {
+    int fd = 0;
+    if (quoted) {
+        return -1;
+    }
+    if (operator == '>' && strcmp(word, "&") == 0) {
+        return -2;
+    }
+    for (; *word != '\0'; word++) {
+        if (*word < '0' || *word > '9' || fd > 9999) {
+            return -1;
+        }
+        fd = fd * 10 + *word - '0';
+    }
+    return fd;
+}
+
+/*
+    Function that lexes a command line of any length in a single pass. The lexer is driven by
+    char_classes and splits words in place, removing quotes and backslash escapes, so the words
+    stored in command point into user_input. A NULL ends each stage of the pipeline, and the stages
+    with their redirections are stored in command. Words with unquoted $ are only recorded in the
+    command's expansions. Returns 1 if there is a command to run, 0 for a blank line or a comment
+    and -1 for a syntax error
+*/
+int lex_command_line(char* user_input, struct command* command) {
+    char* read = user_input;
+    char* write = user_input;
+    char* word = NULL;
+    char* end;
+    char** argv;
+    char redirect = 0;
+    int redirect_type = 0;
+    int redirect_fd = 0;
+    int operator_fd = -1;
+    int source_fd;
+    int has_marks = 0;
+    int quoted = 0;
+    int ampersand = 0;
+    int i;
+
+    clear_command(command);
+    add_stage(command);
+
+    while (1) {
+        char c = *read++;
+
+        // A line whose first word starts with # is a comment
+        if (c == '#' && word == NULL && command->word_count == 0 && redirect == 0 && command->stage_count == 1) {
+            return 0;
+        }
+
+        switch (char_classes[(unsigned char)c]) {
+            case CHAR_WORD:
+                // The run of plain bytes up to the next special one is moved over in one go
+                if (word == NULL) {
+                    word = write;
+                }
+                *write++ = c;
+                end = scan_special(read);
+                if (write != read) {
+                    memmove(write, read, end - read);
+                }
+                write += end - read;
+                read = end;
+                continue;
+            case CHAR_DOLLAR:
+                if (word == NULL) {
+                    word = write;
+                }
+                *write++ = EXPANSION_MARK;
+                has_marks = 1;
+                if (*read == '(' && copy_command_text(&read, &write) == -1) {
+                    return -1;
+                }
+                continue;
+            case CHAR_BACKSLASH:
+                // The next character is taken literally
+                if (word == NULL) {
+                    word = write;
+                }
+                quoted = 1;
+                if (has_marks) {
+                    *write++ = EXPANSION_BOUNDARY;
+                }
+                if (*read != '\0' && *read != '\n') {
+                    *write++ = *read++;
+                }
+                continue;
+            case CHAR_SINGLE_QUOTE:
+                // Everything up to the closing quote is taken literally
+                if (word == NULL) {
+                    word = write;
+                }
+                quoted = 1;
+                if (has_marks) {
+                    *write++ = EXPANSION_BOUNDARY;
+                }
+                while (*read != '\'') {
+                    if (*read == '\0') {
+                        printf("syntax error: unterminated quote\n");
+                        fflush(stdout);
+                        return -1;
+                    }
+                    *write++ = *read++;
+                }
+                read++;
+                continue;
+            case CHAR_DOUBLE_QUOTE:
+                // Inside double quotes only $ is special, and a backslash escapes \, " and $
+                if (word == NULL) {
+                    word = write;
+                }
+                quoted = 1;
+                if (has_marks) {
+                    *write++ = EXPANSION_BOUNDARY;
+                }
+                while (*read != '"') {
+                    if (*read == '\0') {
+                        printf("syntax error: unterminated quote\n");
+                        fflush(stdout);
+                        return -1;
+                    }
+                    if (*read == '\\' && (read[1] == '\\' || read[1] == '"' || read[1] == '$')) {
+                        read++;
+                        *write++ = *read++;
+                    }
+                    else if (*read == '$') {
+                        *write++ = EXPANSION_MARK;
+                        has_marks = 1;
+                        read++;
+                        if (*read == '(' && copy_command_text(&read, &write) == -1) {
+                            return -1;
+                        }
+                    }
+                    else {
+                        *write++ = *read++;
+                    }
+                }
+                if (has_marks) {
+                    *write++ = EXPANSION_BOUNDARY;
+                }
+                read++;
+                continue;
+        }
+
+        // '<(' or '>(' starts a process substitution word. The command's text is kept as it is, up to
+        // the matching parenthesis outside of quotes, to be lexed when it is started
+        if (char_classes[(unsigned char)c] == CHAR_REDIRECT && *read == '(' && word == NULL) {
+            end = find_closing(read + 1);
+            if (end == NULL) {
+                printf("syntax error: unterminated %c(\n", c);
+                fflush(stdout);
+                return -1;
+            }
+            word = write;
+            *write++ = PROCESS_MARK;
+            *write++ = c;
+            memmove(write, read + 1, end - read - 1);
+            write += end - read - 1;
+            read = end + 1;
+            has_marks = 1;
+            continue;
+        }
+
+        // Any other character ends the current word, which is either a redirection target, the fd
+        // number of the redirection operator that follows it or the next argument
+        if (word != NULL) {
+            *write++ = '\0';
+            if (redirect != 0) {
+                add_redirection(command, redirect_type, redirect_fd < 0 ? 1 : redirect_fd,
+                                redirect_type == REDIRECT_HERE_DOC ? quoted : -1, word);
+                // A here-document's delimiter is taken literally
+                if (has_marks && redirect_type != REDIRECT_HERE_DOC) {
+                    add_expansion(command, -command->redirection_count);
+                }
+                // '&>' and '&>>' also send stderr where stdout goes
+                if (redirect_fd == -2) {
+                    add_redirection(command, REDIRECT_DUP, 2, 1, NULL);
+                }
+            }
+            else if (char_classes[(unsigned char)c] == CHAR_REDIRECT && (operator_fd = redirection_fd(word, quoted, c)) != -1) {
+                write = word;
+            }
+            else {
+                add_word(command, word);
+                // Only an unquoted & can make the command run in the background
+                ampersand = !quoted && strcmp(word, "&") == 0;
+                if (has_marks) {
+                    add_expansion(command, command->word_count - 1);
+                }
+            }
+            word = NULL;
+            redirect = 0;
+            has_marks = 0;
+            quoted = 0;
+        }
+
+        if (char_classes[(unsigned char)c] == CHAR_BLANK) {
+            continue;
+        }
+        // An operator or the end of the line cannot follow a redirection symbol
+        if (redirect != 0) {
+            printf("syntax error near %c\n", redirect);
+            fflush(stdout);
+            return -1;
+        }
+        if (char_classes[(unsigned char)c] == CHAR_END) {
+            break;
+        }
+        // Check for the redirection operators: '<', '>', '>>', '<>', '<<', '<<<', and '<&' or '>&'
+        // followed by an fd number or '-'. They apply to stdin or stdout unless an fd number was given
+        if (char_classes[(unsigned char)c] == CHAR_REDIRECT) {
+            redirect_fd = operator_fd != -1 ? operator_fd : (c == '<' ? 0 : 1);
+            operator_fd = -1;
+            redirect_type = c == '<' ? REDIRECT_INPUT : REDIRECT_OUTPUT;
+            if (*read == '>') {
+                redirect_type = c == '<' ? REDIRECT_READ_WRITE : REDIRECT_APPEND;
+                read++;
+            }
+            else if (c == '<' && *read == '<') {
+                redirect_type = read[1] == '<' ? REDIRECT_HERE_STRING : REDIRECT_HERE_DOC;
+                read += read[1] == '<' ? 2 : 1;
+            }
+            else if (*read == '&' && redirect_fd != -2) {
+                // The fd is duplicated from the fd number that follows, or closed by '-'. Either must
+                // end at a blank or an operator
+                read++;
+                if (*read == '-') {
+                    add_redirection(command, REDIRECT_CLOSE, redirect_fd, -1, NULL);
+                    read++;
+                }
+                else if (*read >= '0' && *read <= '9') {
+                    // Only fds 0 to 9 can be named, the ones above belong to the shell
+                    source_fd = strtol(read, &read, 10);
+                    if (source_fd >= SHELL_FD_MIN) {
+                        printf("%i: bad file descriptor\n", source_fd);
+                        fflush(stdout);
+                        return -1;
+                    }
+                    add_redirection(command, REDIRECT_DUP, redirect_fd, source_fd, NULL);
+                }
+                if (read[-1] == '&' || char_classes[(unsigned char)*read] == CHAR_WORD) {
+                    printf("syntax error near %c&\n", c);
+                    fflush(stdout);
+                    return -1;
+                }
+                continue;
+            }
+            redirect = c;
+        }
+        // Check for special symbol | that starts the next stage of a pipeline
+        else {
+            add_word(command, NULL);
+            add_stage(command);
+        }
+    }
+
+    // If user enters nothing there is nothing to run
+    if (command->word_count == 0 && command->stage_count == 1 && command->redirection_count == 0) {
+        return 0;
+    }
+
+    // See if an & is present indicating a background process
+    argv = command->words;
+    if (command->word_count > 0 && argv[command->word_count - 1] != NULL && ampersand) {
+        argv[command->word_count - 1] = NULL;
+        command->background_mode_flag = 1;
+    }
+    else {
+        add_word(command, NULL);
+        command->background_mode_flag = 0;
+    }
+
+    // The words array no longer moves, so each stage can now point at its first word
+    argv = command->words;
+    for (i = 0; i < command->stage_count; i++) {
+        command->stages[i].argv = argv;
+        while (*argv++ != NULL);
+    }
+    attach_redirections(command);
+
+    // Every stage of a pipeline needs a command
+    for (i = 0; i < command->stage_count; i++) {
+        if (command->stages[i].argv[0] == NULL) {
+            printf("syntax error: missing command\n");
+            fflush(stdout);
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/*
+    Function that computes the hash of a raw command line and its length
+*/
+unsigned int hash_line(char* line, size_t* length) {
+    unsigned int hash = 5381;
+    char* c;
+    for (c = line; *c; c++) {
+        hash = hash * 33 + (unsigned char)*c;
+    }
+    *length = c - line;
+    return hash;
+}
+
+/*
+    Function that returns the offset of a word in the lexed text, or -1 for NULL
+*/
+int text_offset(char* text, char* word) {
+    return word != NULL ? word - text : -1;
+}
+
+/*
+    Function that saves a lexed command before it is expanded, along with the raw line it was lexed
+    from unless line is NULL. Returns NULL if no memory is left
+*/
+struct cached_command* save_command(char* line, size_t line_length, struct command* command) {
+    struct cached_command* entry;
+    char* text = command->text;
+    int i;
+    size_t size = sizeof(struct cached_command) + command->word_count * sizeof(int) +
+                  command->stage_count * sizeof(struct cached_stage) +
+                  command->redirection_count * sizeof(struct cached_redirection) + command->expansion_count * sizeof(int) +
+                  command->text_length + 1 + (line != NULL ? line_length + 1 : 0);
+
+    entry = malloc(size);
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->hash = 0;
+    entry->line_length = line_length;
+    entry->text_length = command->text_length;
+    entry->word_count = command->word_count;
+    entry->stage_count = command->stage_count;
+    entry->redirection_count = command->redirection_count;
+    entry->expansion_count = command->expansion_count;
+    entry->background_mode_flag = command->background_mode_flag;
+    entry->words = (int*)(entry + 1);
+    entry->stages = (struct cached_stage*)(entry->words + entry->word_count);
+    entry->redirections = (struct cached_redirection*)(entry->stages + entry->stage_count);
+    entry->expansions = (int*)(entry->redirections + entry->redirection_count);
+    entry->text = (char*)(entry->expansions + entry->expansion_count);
+    memcpy(entry->text, text, command->text_length + 1);
+    entry->line = NULL;
+    if (line != NULL) {
+        entry->line = entry->text + command->text_length + 1;
+        memcpy(entry->line, line, line_length + 1);
+    }
+    for (i = 0; i < command->word_count; i++) {
+        entry->words[i] = text_offset(text, command->words[i]);
+    }
+    for (i = 0; i < command->stage_count; i++) {
+        entry->stages[i].argv = command->stages[i].argv - command->words;
+        entry->stages[i].redirection_count = command->stages[i].redirection_count;
+    }
+    for (i = 0; i < command->redirection_count; i++) {
+        entry->redirections[i].type = command->redirections[i].type;
+        entry->redirections[i].fd = command->redirections[i].fd;
+        entry->redirections[i].source = command->redirections[i].source;
+        entry->redirections[i].target = text_offset(text, command->redirections[i].target);
+    }
+    memcpy(entry->expansions, command->expansions, command->expansion_count * sizeof(int));
+    return entry;
+}
+
+/*
+    Function that stores a freshly lexed command in the cache. line is a copy of the raw line
+*/
+void cache_command(unsigned int hash, char* line, size_t line_length, struct command* command) {
+    struct cached_command* entry = save_command(line, line_length, command);
+    if (entry == NULL) {
+        return;
+    }
+    entry->hash = hash;
+    free(command_cache[hash % COMMAND_CACHE_SIZE]);
+    command_cache[hash % COMMAND_CACHE_SIZE] = entry;
+}
+
+/*
+    Function that rebuilds a command from a saved one. The lexed text is copied to the arena,
+    because expansion and the builtins may change it
+*/
+void restore_command(struct cached_command* entry, struct command* command) {
+    char* text = arena_alloc(entry->text_length + 1);
+    struct cached_redirection* redirection;
+    int i, j;
+
+    memcpy(text, entry->text, entry->text_length + 1);
+    clear_command(command);
+    command->text = text;
+    command->text_length = entry->text_length;
+    for (i = 0; i < entry->word_count; i++) {
+        add_word(command, entry->words[i] != -1 ? text + entry->words[i] : NULL);
+    }
+    for (i = 0; i < entry->stage_count; i++) {
+        add_stage(command);
+        command->stages[i].argv = command->words + entry->stages[i].argv;
+        for (j = 0; j < entry->stages[i].redirection_count; j++) {
+            redirection = &entry->redirections[command->redirection_count];
+            add_redirection(command, redirection->type, redirection->fd, redirection->source,
+                            redirection->target != -1 ? text + redirection->target : NULL);
+        }
+    }
+    attach_redirections(command);
+    for (i = 0; i < entry->expansion_count; i++) {
+        add_expansion(command, entry->expansions[i]);
+    }
+    command->background_mode_flag = entry->background_mode_flag;
+}
+
+char* substitute_process(char* word);
+void* grow_array(void* array, int count, size_t size);
+
+/*
+    Function that expands every slot of a lexed command that holds an unquoted $ or a process
+    substitution. The command's process substitutions are those from substitution_first on
+*/
+void expand_command(struct command* command) {
+    int i, slot;
+    char** target;
+    command->substitution_first = substitution_count;
+    for (i = 0; i < command->expansion_count; i++) {
+        slot = command->expansions[i];
+        if (slot >= 0) {
+            target = &command->words[slot];
+        }
+        else {
+            target = &command->redirections[-1 - slot].target;
+        }
+        *target = **target == PROCESS_MARK ? substitute_process(*target) : expand_word(*target);
+    }
+}
+
+/*
+    Function that appends length bytes to a growable buffer, doubling it when it is full
+*/
+void append_text(char** buffer, size_t* used, size_t* capacity, char* text, size_t length) {
+    while (*used + length > *capacity) {
+        *capacity *= 2;
+        *buffer = realloc(*buffer, *capacity);
+        if (*buffer == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(*buffer + *used, text, length);
+    *used += length;
+}
+
+char* read_command_line(int continuation);
+
+/*
+    Function that reads the bodies of the here-documents of a lexed command, the lines after it up
+    to each delimiter. Reading may reuse the buffer the command was lexed in, so its text is moved
+    to the arena first, with the bodies appended after it. That keeps the bodies inside the text
+    of the command, where save_command finds them. A body whose delimiter was not quoted has its
+    $ expanded like a word, with \ escaping $, ` and itself
+*/
+void read_here_documents(struct command* command) {
+    struct redirection* redirection;
+    size_t capacity = command->text_length + 1024;
+    size_t used = 0;
+    size_t delimiter;
+    char* buffer = malloc(capacity);
+    char* old_text = command->text;
+    char *line, *c, *text, *end;
+    char mark = EXPANSION_MARK;
+    int i;
+
+    if (buffer == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    append_text(&buffer, &used, &capacity, old_text, command->text_length + 1);
+    for (i = 0; i < command->redirection_count; i++) {
+        redirection = &command->redirections[i];
+        if (redirection->type != REDIRECT_HERE_DOC) {
+            continue;
+        }
+        // The target is moved from the delimiter to the body, which starts at the end of the text
+        delimiter = redirection->target - old_text;
+        redirection->target = old_text + used;
+        while ((line = read_command_line(1)) != NULL && strcmp(line, buffer + delimiter) != 0) {
+            if (redirection->source) {
+                append_text(&buffer, &used, &capacity, line, strlen(line));
+            }
+            else {
+                for (c = line; *c != '\0'; c++) {
+                    if (*c == '\\' && (c[1] == '$' || c[1] == '`' || c[1] == '\\')) {
+                        c++;
+                    }
+                    else if (*c == '$' && c[1] == '(' && (end = find_closing(c + 2)) != NULL) {
+                        // The command of a $(command) is kept as it is, to be lexed when it runs
+                        append_text(&buffer, &used, &capacity, &mark, 1);
+                        append_text(&buffer, &used, &capacity, c + 1, end - c);
+                        c = end;
+                        continue;
+                    }
+                    else if (*c == '$' && c[1] != '(') {
+                        append_text(&buffer, &used, &capacity, &mark, 1);
+                        continue;
+                    }
+                    append_text(&buffer, &used, &capacity, c, 1);
+                }
+            }
+            append_text(&buffer, &used, &capacity, "\n", 1);
+        }
+        if (line == NULL) {
+            printf("here-document ended by end of input, not '%s'\n", buffer + delimiter);
+            fflush(stdout);
+        }
+        append_text(&buffer, &used, &capacity, "", 1);
+        if (!redirection->source) {
+            add_expansion(command, -1 - i);
+        }
+    }
+
+    // The words and targets are moved along with the text
+    text = arena_alloc(used);
+    memcpy(text, buffer, used);
+    free(buffer);
+    for (i = 0; i < command->word_count; i++) {
+        if (command->words[i] != NULL) {
+            command->words[i] = text + (command->words[i] - old_text);
+        }
+    }
+    for (i = 0; i < command->redirection_count; i++) {
+        if (command->redirections[i].target != NULL) {
+            command->redirections[i].target = text + (command->redirections[i].target - old_text);
+        }
+    }
+    command->text = text;
+    command->text_length = used - 1;
+}
+
+/*
+    Function that parses a command line into command, leaving its expansions for expand_command. A
+    line that is in the command cache is not lexed again. Returns 1 if there is a command to run, 0
+    for a blank line or a comment and -1 for a syntax error
+*/
+int parse_command_line(char* user_input, struct command* command) {
+    struct cached_command* entry;
+    size_t line_length;
+    unsigned int hash = hash_line(user_input, &line_length);
+    char* line = NULL;
+    int result, i;
+
+    entry = command_cache[hash % COMMAND_CACHE_SIZE];
+    if (entry != NULL && entry->hash == hash && entry->line_length == line_length &&
+        memcmp(entry->line, user_input, line_length) == 0) {
+        restore_command(entry, command);
+    }
+    else {
+        // The raw line is kept for the cache before the lexer overwrites it
+        if (line_length <= COMMAND_CACHE_MAX_LINE) {
+            line = arena_alloc(line_length + 1);
+            memcpy(line, user_input, line_length + 1);
+        }
+        result = lex_command_line(user_input, command);
+        if (result != 1) {
+            return result;
+        }
+        command->text = user_input;
+        command->text_length = line_length;
+        // A line with here-documents is followed by their bodies, which can change each time it
+        // is entered, so it is not cached
+        for (i = 0; i < command->redirection_count; i++) {
+            if (command->redirections[i].type == REDIRECT_HERE_DOC) {
+                read_here_documents(command);
+                line = NULL;
+                break;
+            }
+        }
+        if (line != NULL) {
+            cache_command(hash, line, line_length, command);
+        }
+    }
+    return 1;
+}
+
+/*
+    Function that lets the children started next inherit the pipes of process substitutions from
+    first on
+*/
+void share_substitutions(int first) {
+    int i;
+    for (i = first; i < substitution_count; i++) {
+        fcntl(substitution_fds[i], F_SETFD, 0);
+    }
+}
+
+/*
+    Function that closes the pipes of process substitutions from first on, once the command they
+    were made for has started
+*/
+void close_substitutions(int first) {
+    while (substitution_count > first) {
+        close(substitution_fds[--substitution_count]);
+    }
+}
+
+/*
+    Function that puts a redirection in front of those of a stage, so they can still override it
+*/
+void prepend_redirection(struct stage* stage, int type, int fd, int source) {
+    struct redirection* redirections = arena_alloc((stage->redirection_count + 1) * sizeof(struct redirection));
+    redirections[0].type = type;
+    redirections[0].fd = fd;
+    redirections[0].source = source;
+    redirections[0].target = NULL;
+    memcpy(redirections + 1, stage->redirections, stage->redirection_count * sizeof(struct redirection));
+    stage->redirections = redirections;
+    stage->redirection_count++;
+}
+
+/*
+    Function that starts the command of a '<(command)' or '>(command)' word with its stdout or stdin
+    on a pipe, and returns the /dev/fd name of the shell's end of the pipe to take the word's place.
+    The command runs like a background job in the shell's process group and is reaped by the
+    event loop without a report. Returns an empty word if the command cannot be started
+*/
+char* substitute_process(char* word) {
+    struct command command;
+    int reads_output = word[1] == '<';
+    int pipe_fds[2];
+    pid_t* pids;
+    char* name;
+    int started, i;
+
+    if (parse_command_line(word + 2, &command) != 1 || command.background_mode_flag) {
+        return "";
+    }
+    expand_command(&command);
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        close_substitutions(command.substitution_first);
+        return "";
+    }
+    pipe_fds[0] = move_shell_fd(pipe_fds[0]);
+    pipe_fds[1] = move_shell_fd(pipe_fds[1]);
+    // The command writes to the pipe for '<(' and reads from it for '>('
+    if (reads_output) {
+        prepend_redirection(&command.stages[command.stage_count - 1], REDIRECT_DUP, 1, pipe_fds[1]);
+    }
+    else {
+        prepend_redirection(&command.stages[0], REDIRECT_DUP, 0, pipe_fds[0]);
+    }
+    pids = arena_alloc(command.stage_count * sizeof(pid_t));
+    share_substitutions(command.substitution_first);
+    started = launch_pipeline(command.stages, command.stage_count, 0, -1, pids);
+    close_substitutions(command.substitution_first);
+    for (i = 0; i < started; i++) {
+        add_background_job(pids[i], 0, NULL, NULL);
+    }
+    close(pipe_fds[reads_output ? 1 : 0]);
+
+    substitution_fds = grow_array(substitution_fds, substitution_count, sizeof(int));
+    substitution_fds[substitution_count++] = pipe_fds[reads_output ? 0 : 1];
+    name = arena_alloc(32);
+    sprintf(name, "/dev/fd/%d", pipe_fds[reads_output ? 0 : 1]);
+    return name;
+}
+
+struct function* find_function(char* name);
+
+/*
+    Function that runs the command of a command substitution in the shell itself if it is one of the
+    builtins that only print: echo, pwd or status. Their output is appended to the buffer, so no
+    child is needed. Returns 0 if the command is not one of them
+*/
+int capture_builtin(struct command* command, char** buffer, size_t* used, size_t* capacity) {
+    char** argv = command->stages[0].argv;
+    char text[64];
+    char* directory;
+    int newline = 1;
+    int i;
+
+    if (command->stage_count != 1 || command->redirection_count != 0 || command->background_mode_flag) {
+        return 0;
+    }
+    if (strcmp(argv[0], "status") == 0) {
+        if (WIFEXITED(child_exit_status)) {
+            sprintf(text, "exit value %i\n", WEXITSTATUS(child_exit_status));
+        }
+        else {
+            sprintf(text, "terminated by signal %i\n", child_exit_status);
+        }
+        append_text(buffer, used, capacity, text, strlen(text));
+        return 1;
+    }
+    // echo and pwd are programs otherwise, so a function of the same name comes first
+    if (find_function(argv[0]) != NULL) {
+        return 0;
+    }
+    if (strcmp(argv[0], "echo") == 0) {
+        i = 1;
+        if (argv[1] != NULL && strcmp(argv[1], "-n") == 0) {
+            newline = 0;
+            i = 2;
+        }
+        for (; argv[i] != NULL; i++) {
+            append_text(buffer, used, capacity, argv[i], strlen(argv[i]));
+            if (argv[i + 1] != NULL) {
+                append_text(buffer, used, capacity, " ", 1);
+            }
+        }
+        if (newline) {
+            append_text(buffer, used, capacity, "\n", 1);
+        }
+    }
+    else if (strcmp(argv[0], "pwd") == 0 && argv[1] == NULL && (directory = getcwd(NULL, 0)) != NULL) {
+        append_text(buffer, used, capacity, directory, strlen(directory));
+        append_text(buffer, used, capacity, "\n", 1);
+        free(directory);
+    }
+    else {
+        return 0;
+    }
+    child_exit_status = 0;
+    return 1;
+}
+
+void execute_command(struct command* command);
+
+/*
+    Function that returns whether a command of a command substitution needs the shell to run: it is
+    a function or a builtin, or has 'time' or @name=value settings in front
+*/
+int runs_in_shell(struct command* command) {
+    char* name = command->stages[0].argv[0];
+    int i;
+    if (command->stage_count != 1 || name[0] == '@' || find_function(name) != NULL) {
+        return command->stage_count == 1;
+    }
+    for (i = 0; shell_builtins[i] != NULL; i++) {
+        if (strcmp(name, shell_builtins[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Function that runs a command that needs the shell in a forked copy of it, a subshell, with
+    stdout on out_fd unless it is -1, so that a 'cd' or 'exit' in a command substitution leaves the
+    shell alone. A background subshell gets a process group of its own, so SIGINT from the keyboard
+    does not reach it. The copy gets an event loop and a job list of its own and exits with the
+    command's exit value. Returns its pid, or -1 if it cannot be forked
+*/
+pid_t fork_subshell(struct command* command, int out_fd, int background) {
+    pid_t pid;
+    // The copy must not find lines read ahead that the shell still has to take out of stdin
+    sync_input();
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+    }
+    if (pid != 0) {
+        return pid;
+    }
+    if (background) {
+        setpgid(0, 0);
+    }
+    if (out_fd != -1 && dup2(out_fd, STDOUT_FILENO) == -1) {
+        perror("dup2");
+        _exit(1);
+    }
+    close(event_fd);
+    close(signal_fd);
+    job_list = NULL;
+    init_event_loop();
+    // Builtins that succeed leave the exit value alone, so it starts out as success
+    child_exit_status = 0;
+    execute_command(command);
+    fflush(stdout);
+    _exit(WIFEXITED(child_exit_status) ? WEXITSTATUS(child_exit_status) : 128 + WTERMSIG(child_exit_status));
+}
+
+/*
+    Function that runs the command of a command substitution, given as the text between its
+    parentheses, and returns its output without the trailing newlines. Builtins that only print are
+    run by capture_builtin, other builtins and functions by a subshell. Any other command is started
+    with its stdout on a pipe. The pipe is read in large blocks into a buffer that doubles as it
+    fills, and the command waited for, so its status becomes $?
+*/
+char* capture_command(char* text, size_t text_length) {
+    struct command command;
+    size_t capacity = 65536, used = 0;
+    char* buffer = malloc(capacity);
+    char* line = arena_alloc(text_length + 1);
+    char* output;
+    ssize_t bytes;
+    int pipe_fds[2];
+    pid_t* pids;
+    int started, i;
+
+    if (buffer == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(line, text, text_length);
+    line[text_length] = '\0';
+    if (parse_command_line(line, &command) == 1) {
+        expand_command(&command);
+        if (!capture_builtin(&command, &buffer, &used, &capacity) && pipe2(pipe_fds, O_CLOEXEC) == 0) {
+            pipe_fds[1] = move_shell_fd(pipe_fds[1]);
+            pids = arena_alloc(command.stage_count * sizeof(pid_t));
+            if (runs_in_shell(&command)) {
+                pids[0] = fork_subshell(&command, pipe_fds[1], 0);
+                started = pids[0] != -1;
+            }
+            else {
+                prepend_redirection(&command.stages[command.stage_count - 1], REDIRECT_DUP, 1, pipe_fds[1]);
+                share_substitutions(command.substitution_first);
+                started = launch_pipeline(command.stages, command.stage_count, 0, -1, pids);
+            }
+            close(pipe_fds[1]);
+            while ((bytes = read(pipe_fds[0], buffer + used, capacity - used)) != 0) {
+                if (bytes == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    perror("read");
+                    break;
+                }
+                used += bytes;
+                if (used == capacity) {
+                    append_text(&buffer, &used, &capacity, "", 1);
+                    used--;
+                }
+            }
+            close(pipe_fds[0]);
+            for (i = 0; i < started; i++) {
+                waitpid(pids[i], &child_exit_status, 0);
+            }
+        }
+        close_substitutions(command.substitution_first);
+    }
+
+    // Trailing newlines are dropped, and so are bytes that expansion would take for marks
+    while (used > 0 && buffer[used - 1] == '\n') {
+        used--;
+    }
+    output = arena_alloc(used + 1);
+    for (i = 0, text_length = 0; (size_t)i < used; i++) {
+        if (buffer[i] != EXPANSION_MARK && buffer[i] != EXPANSION_BOUNDARY && buffer[i] != PROCESS_MARK) {
+            output[text_length++] = buffer[i];
+        }
+    }
+    output[text_length] = '\0';
+    free(buffer);
+    return output;
+}
+
+/*
+    Function that replaces each $(command) of a word from the lexer by the command's output. A $(
+    without its closing parenthesis is kept as it is
+*/
+char* substitute_commands(char* word) {
+    char *cursor, *mark, *end, *output, *result;
+    size_t capacity = 256, used = 0;
+    char* buffer = malloc(capacity);
+
+    if (buffer == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (cursor = word; (mark = strstr(cursor, (char[]){ EXPANSION_MARK, '(', '\0' })) != NULL; cursor = end + 1) {
+        append_text(&buffer, &used, &capacity, cursor, mark - cursor);
+        end = find_closing(mark + 2);
+        if (end == NULL) {
+            append_text(&buffer, &used, &capacity, "$", 1);
+            end = mark;
+            continue;
+        }
+        output = capture_command(mark + 2, end - mark - 2);
+        append_text(&buffer, &used, &capacity, output, strlen(output));
+    }
+    append_text(&buffer, &used, &capacity, cursor, strlen(cursor) + 1);
+    result = arena_alloc(used);
+    memcpy(result, buffer, used);
+    free(buffer);
+    return result;
+}
+
+/*
+    Function that implements the 'parallel -j N [command [args]]' builtin. It reads lines from
+    its input redirection, or from the shell's stdin, and keeps N jobs running until the input ends:
+    each line is a whole command line, or the final argument of the given command. A slot is refilled
+    as soon as its job is reaped by the event loop. SIGINT stops it from starting more jobs, and
+    only the ones still running are waited for. Redirections of stdout and stderr apply to every
+    job, in front of the job's own. Returns the number of failed jobs, at most 255
+*/
+int builtin_fds(struct stage* stage, int* opened, int fds[3]);
+
+int parallel_builtin(struct stage* stage) {
+    char *line = NULL, *user_input, *prefix, *end;
+    size_t line_size = 0, prefix_length = 0;
+    ssize_t line_length;
+    struct command command;
+    pid_t* pids;
+    struct job_group group = { 0, 0 };
+    struct arena_mark mark;
+    FILE* input = NULL;
+    int* opened;
+    int fds[3];
+    int max_jobs = 1;
+    int first_word = 1;
+    int more_input = 1;
+    int started, fd, i;
+
+    if (stage->argv[1] != NULL && strcmp(stage->argv[1], "-j") == 0 && stage->argv[2] != NULL) {
+        max_jobs = atoi(stage->argv[2]);
+        first_word = 3;
+    }
+    if (max_jobs < 1) {
+        printf("parallel: usage: parallel -j N [command [args]]\n");
+        fflush(stdout);
+        return 1;
+    }
+    // The command is copied out first, because reading the shell's stdin reuses the buffer its
+    // words are in
+    for (i = first_word; stage->argv[i] != NULL; i++) {
+        prefix_length += strlen(stage->argv[i]) + 1;
+    }
+    prefix = end = arena_alloc(prefix_length + 1);
+    for (i = first_word; stage->argv[i] != NULL; i++) {
+        end = stpcpy(end, stage->argv[i]);
+        *end++ = ' ';
+    }
+
+    // The redirections are followed over stdin, stdout and stderr the way builtin_fds does for the
+    // builtins run in the shell. Their files are moved above the fds users can name, so the
+    // redirections the jobs get for them are accepted
+    for (i = 0; i < stage->redirection_count; i++) {
+        if (stage->redirections[i].fd > 2) {
+            printf("parallel: only stdin, stdout and stderr can be redirected\n");
+            fflush(stdout);
+            return 1;
+        }
+    }
+    opened = arena_alloc(stage->redirection_count * sizeof(int));
+    if (open_redirections(stage, 1, opened) == -1) {
+        return 1;
+    }
+    for (i = 0; i < stage->redirection_count; i++) {
+        opened[i] = move_shell_fd(opened[i]);
+    }
+    builtin_fds(stage, opened, fds);
+    if (fds[0] != STDIN_FILENO &&
+        (fds[0] == -1 || (fd = fcntl(fds[0], F_DUPFD_CLOEXEC, SHELL_FD_MIN)) == -1 || (input = fdopen(fd, "r")) == NULL)) {
+        perror("parallel");
+        more_input = 0;
+        group.failed = 1;
+    }
+    mark = arena_save();
+
+    interrupt_received = 0;
+    while (more_input || group.running > 0) {
+        if (interrupt_received) {
+            more_input = 0;
+        }
+        // Free slots are filled with the next input lines. Each line's expansions are released
+        // from the arena once its job is launched
+        while (more_input && group.running < max_jobs) {
+            arena_release(mark);
+            if (input != NULL) {
+                line_length = getline(&line, &line_size, input);
+            }
+            else {
+                line = read_input_line();
+                line_length = line != NULL ? (ssize_t)strlen(line) : -1;
+            }
+            if (line_length == -1) {
+                more_input = 0;
+                break;
+            }
+            // In argument mode the line is appended to the given command
+            user_input = arena_alloc(prefix_length + line_length + 1);
+            memcpy(user_input, prefix, prefix_length);
+            memcpy(user_input + prefix_length, line, line_length + 1);
+            if (parse_command_line(user_input, &command) != 1) {
+                continue;
+            }
+            expand_command(&command);
+            if (fds[1] != STDOUT_FILENO) {
+                prepend_redirection(&command.stages[command.stage_count - 1],
+                                    fds[1] == -1 ? REDIRECT_CLOSE : REDIRECT_DUP, 1, fds[1]);
+            }
+            for (i = 0; i < command.stage_count && fds[2] != STDERR_FILENO; i++) {
+                prepend_redirection(&command.stages[i], fds[2] == -1 ? REDIRECT_CLOSE : REDIRECT_DUP, 2, fds[2]);
+            }
+
+            // The jobs stay in the shell's process group so SIGINT from the keyboard stops them
+            pids = arena_alloc(command.stage_count * sizeof(pid_t));
+            share_substitutions(command.substitution_first);
+            started = launch_pipeline(command.stages, command.stage_count, 0, -1, pids);
+            close_substitutions(command.substitution_first);
+            for (i = 0; i < started; i++) {
+                add_background_job(pids[i], i == started - 1, &group, NULL);
+            }
+            // A job whose redirections could not be opened never started and takes no slot
+            if (started > 0) {
+                group.running++;
+            }
+            else {
+                group.failed++;
+            }
+        }
+        // Wait for a job to finish
+        if (group.running > 0) {
+            run_event_loop(EVENTS_ONCE);
+        }
+    }
+
+    if (input != NULL) {
+        free(line);
+        fclose(input);
+    }
+    for (i = 0; i < stage->redirection_count; i++) {
+        if (opened[i] != -1) {
+            close(opened[i]);
+        }
+    }
+    return group.failed > 255 ? 255 : group.failed;
+}
+
+/*
+    Function that runs 'parallel ... &' in a background subshell, reported like any background job
+*/
+void parallel_background(struct command* command) {
+    struct stage* stage = &command->stages[0];
+    pid_t pid;
+    int i;
+
+    for (i = 0; i < stage->redirection_count && stage->redirections[i].fd != 0; i++);
+    if (i == stage->redirection_count) {
+        printf("parallel: in the background its input must be redirected\n");
+        fflush(stdout);
+        child_exit_status = 1 << 8;
+        return;
+    }
+    command->background_mode_flag = 0;
+    pid = fork_subshell(command, -1, 1);
+    if (pid == -1) {
+        child_exit_status = 1 << 8;
+        return;
+    }
+    printf("background pid is %d\n", pid);
+    sprintf(last_background_pid, "%d", pid);
+    fflush(stdout);
+    add_background_job(pid, 1, NULL, NULL);
+}
+
+/*
+    Function that returns whether SIGINT has arrived and is waiting in the signalfd. Builtins that
+    run for long check it to stop the way a foreground child would
+*/
+int interrupted(void) {
+    sigset_t pending;
+    return sigpending(&pending) == 0 && sigismember(&pending, SIGINT);
+}
+
+/*
+    Function that copies everything from in_fd to out_fd, keeping the data in the kernel where it
+    can: copy_file_range between regular files, sendfile from a regular file to anything else and
+    splice when either side is a pipe. When the kernel refuses one, the next is tried, down to a
+    read and write loop through a buffer. Returns 0, -1 with errno set on an error or -2 if SIGINT
+    arrived
+*/
+int copy_fd(int in_fd, int out_fd) {
+    struct stat in_info, out_info;
+    char* buffer;
+    ssize_t bytes;
+    int method;
+
+    if (fstat(in_fd, &in_info) == -1 || fstat(out_fd, &out_info) == -1) {
+        return -1;
+    }
+    if (S_ISREG(in_info.st_mode) && S_ISREG(out_info.st_mode)) {
+        method = COPY_FILE_RANGE;
+    }
+    else if (S_ISREG(in_info.st_mode)) {
+        method = COPY_SENDFILE;
+    }
+    else if (S_ISFIFO(in_info.st_mode) || S_ISFIFO(out_info.st_mode)) {
+        method = COPY_SPLICE;
+    }
+    else {
+        method = COPY_READ_WRITE;
+    }
+
+    while (method != COPY_READ_WRITE) {
+        if (method == COPY_FILE_RANGE) {
+            bytes = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK, 0);
+        }
+        else if (method == COPY_SENDFILE) {
+            bytes = sendfile(out_fd, in_fd, NULL, COPY_CHUNK);
+        }
+        else {
+            bytes = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK, SPLICE_F_MOVE);
+        }
+        if (bytes == 0) {
+            return 0;
+        }
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // copy_file_range fails across some filesystems and on an O_APPEND file, sendfile
+            // and splice on files that do not support them. The fds keep their offsets, so the
+            // next way carries on from where this one stopped
+            if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF) {
+                return -1;
+            }
+            method = method == COPY_FILE_RANGE ? COPY_SENDFILE : COPY_READ_WRITE;
+            continue;
+        }
+        if (interrupted()) {
+            return -2;
+        }
+    }
+
+    buffer = malloc(COPY_BUFFER_SIZE);
+    if (buffer == NULL) {
+        return -1;
+    }
+    while ((bytes = read(in_fd, buffer, COPY_BUFFER_SIZE)) != 0) {
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes != -1 && write_all(out_fd, buffer, bytes) == -1) {
+            bytes = -1;
+        }
+        if (bytes == -1 || interrupted()) {
+            free(buffer);
+            return bytes == -1 ? -1 : -2;
+        }
+    }
+    free(buffer);
+    return 0;
+}
+
+/*
+    Function that works out which fds a builtin running in the shell uses as stdin, stdout and
+    stderr, by following the redirections of its stage over a map of fds 0 to 9 instead of changing
+    the shell's own. opened has the files open_redirections opened for them, or is NULL to only
+    check what the redirections do. Returns -1 if one reaches beyond fd 9, so it cannot be followed
+*/
+int builtin_fds(struct stage* stage, int* opened, int fds[3]) {
+    struct redirection* redirection;
+    int map[10];
+    int i;
+
+    for (i = 0; i < 10; i++) {
+        map[i] = i;
+    }
+    for (i = 0; i < stage->redirection_count; i++) {
+        redirection = &stage->redirections[i];
+        if (redirection->fd > 9 || (redirection->type == REDIRECT_DUP && redirection->source > 9)) {
+            return -1;
+        }
+        if (redirection->type == REDIRECT_CLOSE) {
+            map[redirection->fd] = -1;
+        }
+        else if (redirection->type == REDIRECT_DUP) {
+            map[redirection->fd] = map[redirection->source];
+        }
+        else {
+            map[redirection->fd] = opened != NULL ? opened[i] : 10 + i;
+        }
+    }
+    memcpy(fds, map, 3 * sizeof(int));
+    return 0;
+}
+
+/*
+    Function that returns whether a path, relative to the shell's working directory, is a regular
+    file
+*/
+int regular_file(char* path) {
+    struct stat info;
+    return fstatat(cwd_fd, path, &info, 0) == 0 && S_ISREG(info.st_mode);
+}
+
+/*
+    Function that returns whether a 'cat' or 'cp' command can be run by the shell itself: it has no
+    options, which are left to the real programs, cp has a source and a destination, and cat does
+    not read the shell's own stdin, which the command reader may have read ahead. Every source must
+    be a regular file or a here-document, because the shell only notices SIGINT between chunks and
+    a FIFO or a device could keep it waiting for good
+*/
+int copy_builtin_applies(struct stage* stage) {
+    struct redirection* redirection;
+    struct stat info;
+    char** argv = stage->argv;
+    int reads_stdin;
+    int fds[3];
+    int i;
+
+    for (i = 1; argv[i] != NULL; i++) {
+        if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            return 0;
+        }
+    }
+    if (builtin_fds(stage, NULL, fds) == -1) {
+        return 0;
+    }
+    if (strcmp(argv[0], "cp") == 0) {
+        return i == 3 && regular_file(argv[1]);
+    }
+    reads_stdin = argv[1] == NULL;
+    for (i = 1; argv[i] != NULL; i++) {
+        if (strcmp(argv[i], "-") == 0) {
+            reads_stdin = 1;
+        }
+        else if (!regular_file(argv[i])) {
+            return 0;
+        }
+    }
+    if (!reads_stdin) {
+        return 1;
+    }
+    // builtin_fds numbers the files of the redirections from 10 up
+    if (fds[0] >= 10) {
+        redirection = &stage->redirections[fds[0] - 10];
+        return redirection->type == REDIRECT_HERE_DOC || redirection->type == REDIRECT_HERE_STRING ||
+               regular_file(redirection->target);
+    }
+    return fds[0] != STDIN_FILENO && fstat(fds[0], &info) == 0 && S_ISREG(info.st_mode);
+}
+
+/*
+    Function that implements the 'cat [FILE...]' builtin. The files, or stdin for none or '-', are
+    copied to out_fd and errors reported on err_fd. Returns the exit value, or -2 if interrupted
+*/
+int cat_builtin(char** argv, int in_fd, int out_fd, int err_fd) {
+    struct stat in_info, out_info;
+    char* standard_input[] = { "cat", "-", NULL };
+    char* name;
+    int status = 0;
+    int fd, result, i;
+
+    if (argv[1] == NULL) {
+        argv = standard_input;
+    }
+    fstat(out_fd, &out_info);
+    for (i = 1; argv[i] != NULL; i++) {
+        name = argv[i];
+        fd = strcmp(name, "-") == 0 ? in_fd : openat(cwd_fd, name, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            dprintf(err_fd, "cat: %s: %s\n", name, strerror(errno));
+            status = 1;
+            continue;
+        }
+        // Appending a regular file to itself would never end
+        if (fstat(fd, &in_info) == 0 && S_ISREG(in_info.st_mode) && S_ISREG(out_info.st_mode) &&
+            in_info.st_dev == out_info.st_dev && in_info.st_ino == out_info.st_ino) {
+            dprintf(err_fd, "cat: %s: input file is output file\n", name);
+            result = 0;
+            status = 1;
+        }
+        else if ((result = copy_fd(fd, out_fd)) == -1) {
+            dprintf(err_fd, "cat: %s: %s\n", name, strerror(errno));
+            status = 1;
+        }
+        if (fd != in_fd) {
+            close(fd);
+        }
+        if (result == -2) {
+            return -2;
+        }
+    }
+    return status;
+}
+
+/*
+    Function that implements the 'cp SOURCE DEST' builtin. DEST may be a directory to copy into. A
+    new file gets the permissions of the source. Errors are reported on err_fd. Returns the exit
+    value, or -2 if interrupted
+*/
+int cp_builtin(char** argv, int err_fd) {
+    struct stat source_info, dest_info;
+    char *dest = argv[2], *base;
+    int in_fd, out_fd, result;
+
+    in_fd = openat(cwd_fd, argv[1], O_RDONLY | O_CLOEXEC);
+    if (in_fd == -1 || fstat(in_fd, &source_info) == -1) {
+        dprintf(err_fd, "cp: cannot stat '%s': %s\n", argv[1], strerror(errno));
+        if (in_fd != -1) {
+            close(in_fd);
+        }
+        return 1;
+    }
+    if (S_ISDIR(source_info.st_mode)) {
+        dprintf(err_fd, "cp: -r not specified; omitting directory '%s'\n", argv[1]);
+        close(in_fd);
+        return 1;
+    }
+    // Copying into a directory keeps the source's name
+    if (fstatat(cwd_fd, dest, &dest_info, 0) == 0 && S_ISDIR(dest_info.st_mode)) {
+        base = strrchr(argv[1], '/') != NULL ? strrchr(argv[1], '/') + 1 : argv[1];
+        dest = arena_alloc(strlen(argv[2]) + strlen(base) + 2);
+        sprintf(dest, "%s/%s", argv[2], base);
+    }
+    if (fstatat(cwd_fd, dest, &dest_info, 0) == 0 && dest_info.st_dev == source_info.st_dev &&
+        dest_info.st_ino == source_info.st_ino) {
+        dprintf(err_fd, "cp: '%s' and '%s' are the same file\n", argv[1], dest);
+        close(in_fd);
+        return 1;
+    }
+    out_fd = openat(cwd_fd, dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, source_info.st_mode & 07777);
+    if (out_fd == -1) {
+        dprintf(err_fd, "cp: cannot create regular file '%s': %s\n", dest, strerror(errno));
+        close(in_fd);
+        return 1;
+    }
+    result = copy_fd(in_fd, out_fd);
+    if (result == -1) {
+        dprintf(err_fd, "cp: error copying '%s' to '%s': %s\n", argv[1], dest, strerror(errno));
+    }
+    close(in_fd);
+    close(out_fd);
+    return result == -2 ? -2 : result != 0;
+}
+
+/*
+    Function that runs the 'cat' and 'cp' builtins in the shell, with the redirections of their
+    stage opened as for a child. SIGPIPE is held off while they run, so a reader going away gives
+    them EPIPE instead of killing the shell. Returns the wait status the command gets: its exit
+    value, or SIGINT if it was interrupted
+*/
+int copy_builtin(struct stage* stage) {
+    int* opened = arena_alloc(stage->redirection_count * sizeof(int));
+    struct timespec no_wait = { 0, 0 };
+    sigset_t pipe_signal, saved_mask;
+    int fds[3];
+    int result, i;
+
+    if (open_redirections(stage, 1, opened) == -1) {
+        return 1 << 8;
+    }
+    builtin_fds(stage, opened, fds);
+
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipe_signal, &saved_mask);
+    if (strcmp(stage->argv[0], "cat") == 0) {
+        result = cat_builtin(stage->argv, fds[0], fds[1], fds[2]);
+    }
+    else {
+        result = cp_builtin(stage->argv, fds[2]);
+    }
+    // A SIGPIPE raised meanwhile is taken off before it is unblocked
+    if (sigtimedwait(&pipe_signal, NULL, &no_wait) == -1 && errno != EAGAIN) {
+        perror("sigtimedwait");
+    }
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+
+    for (i = 0; i < stage->redirection_count; i++) {
+        if (opened[i] != -1) {
+            close(opened[i]);
+        }
+    }
+    return result == -2 ? SIGINT : result << 8;
+}
+
+/*
+    Function that runs a parsed pipeline that is not a builtin. A foreground pipeline is waited for
+    and its last stage's status becomes child_exit_status; a background one is handed to the event
+    loop. timed asks for the 'time' summary, options may place the job on given CPUs and NUMA node,
+    and in cgroup mode the job gets its own cgroup with the limits from options
+*/
+void run_pipeline(struct stage* stages, int stage_count, int background_mode_flag, int timed, struct job_options* options) {
+    struct job_usage* usage = NULL;
+    struct rusage child_usage;
+    struct saved_placement saved;
+    pid_t* pids = arena_alloc(stage_count * sizeof(pid_t));
+    int cgroup_fd = -1;
+    int i, started;
+
+    if (timed || cgroup_root != NULL) {
+        usage = calloc(1, sizeof(struct job_usage));
+        usage->timed = timed;
+        clock_gettime(CLOCK_MONOTONIC, &usage->start);
+    }
+    if (cgroup_root != NULL) {
+        cgroup_fd = create_job_cgroup(usage, options);
+        if (cgroup_fd == -1) {
+            free(usage);
+            return;
+        }
+    }
+    started = 0;
+    if (apply_placement(options, background_mode_flag == 1 && foreground_mode_flag == 0, &saved) == 0) {
+        share_substitutions(0);
+        started = launch_pipeline(stages, stage_count, background_mode_flag, cgroup_fd, pids);
+        restore_placement(&saved);
+    }
+    if (cgroup_fd != -1) {
+        close(cgroup_fd);
+    }
+    if (started == 0) {
+        if (usage != NULL) {
+            finish_job_usage(usage, 0);
+        }
+        return;
+    }
+
+    // If the pipeline runs in the foreground, wait for every stage to finish. The status of the
+    // pipeline is the status of its last stage, or 1 if not all of them could be started
+    if (foreground_mode_flag == 1 || background_mode_flag == 0) {
+        for (i = 0; i < started; i++) {
+            wait4(pids[i], &child_exit_status, 0, &child_usage);
+            if (usage != NULL) {
+                add_rusage(&usage->usage, &child_usage);
+            }
+        }
+        if (started < stage_count) {
+            child_exit_status = 1 << 8;
+        }
+        if (usage != NULL) {
+            finish_job_usage(usage, 1);
+        }
+    }
+    // If the pipeline is a background process, proceed to run in the background. Only the last
+    // stage is reported when it finishes, followed by the usage summary once every stage is done
+    else if(background_mode_flag == 1){
+        printf("background pid is %d\n", pids[started - 1]);
+        sprintf(last_background_pid, "%d", pids[started - 1]);
+        fflush(stdout);
+        if (usage != NULL) {
+            usage->running = started;
+        }
+        for (i = 0; i < started; i++) {
+            add_background_job(pids[i], i == started - 1, NULL, usage);
+        }
+    }
+}
+
+/*
+    Function that returns the next line of the script. Lines are split where they lie in the
+    mapping, with their newline replaced by a '\0'. Only a last line without a newline and nothing
+    readable after it is copied out. Returns NULL at the end of the script
+*/
+char* read_script_text(void) {
+    char* line = script_next;
+    char* newline;
+    size_t length;
+
+    if (line == script_end) {
+        return NULL;
+    }
+    newline = memchr(line, '\n', script_end - line);
+    if (newline != NULL) {
+        *newline = '\0';
+        script_next = newline + 1;
+        return line;
+    }
+    script_next = script_end;
+    if (script_terminated) {
+        return line;
+    }
+    length = script_end - line;
+    if (input_size < length + 1) {
+        input_size = length + 1;
+        input_line = realloc(input_line, input_size);
+        if (input_line == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(input_line, line, length);
+    input_line[length] = '\0';
+    return input_line;
+}
+
+/*
+    Function that maps a script file for read_script_text. The mapping is private and writable, so
+    lines can be split and lexed in place without changing the file. Returns -1 if the file cannot
+    be read
+*/
+int map_script(char* path) {
+    struct stat file_info;
+    char* text;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &file_info) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (file_info.st_size == 0) {
+        close(fd);
+        script_next = script_end = "";
+        return 0;
+    }
+    text = mmap(NULL, file_info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        return -1;
+    }
+    madvise(text, file_info.st_size, MADV_SEQUENTIAL);
+    script_next = text;
+    script_end = text + file_info.st_size;
+
+    // The rest of the last page reads as zeros, unless the file ends on a page boundary
+    script_terminated = file_info.st_size % sysconf(_SC_PAGESIZE) != 0;
+    return 0;
+}
+
+/*
+    Function that shows the prompt, or "> " when a compound command continues on the next line, and
+    reads a line of input. Lines come from the script if one is being run, and no prompt is shown
+    unless the input is a terminal. Returns NULL at the end of the input
+*/
+char* read_command_line(int continuation) {
+    if (script_next != NULL) {
+        return read_script_text();
+    }
+    if (interactive) {
+        printf(continuation ? "> " : ": ");
+        fflush(stdout);
+    }
+
+    // Wait until a command can be read
+    run_event_loop(EVENTS_INPUT);
+    return read_input_line();
+}
+
+/*
+    Function that makes room for one more element at the end of a malloc'd array of count elements.
+    The capacity doubles each time count reaches a power of two, so it does not have to be stored
+*/
+void* grow_array(void* array, int count, size_t size) {
+    if (count == 0 || (count >= 8 && (count & (count - 1)) == 0)) {
+        array = realloc(array, (count == 0 ? 8 : 2 * count) * size);
+        if (array == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    return array;
+}
+
+/*
+    Function that frees a compiled program once nothing refers to it any more
+*/
+void release_program(struct program* program) {
+    int i;
+    if (--program->references > 0) {
+        return;
+    }
+    for (i = 0; i < program->command_count; i++) {
+        free(program->commands[i]);
+    }
+    for (i = 0; i < program->name_count; i++) {
+        free(program->names[i]);
+    }
+    for (i = 0; i < program->function_count; i++) {
+        release_program(program->functions[i]);
+    }
+    free(program->commands);
+    free(program->names);
+    free(program->functions);
+    free(program->code);
+    free(program);
+}
+
+/*
+    Function that returns the shell function with the given name, or NULL if there is none
+*/
+struct function* find_function(char* name) {
+    struct function* function;
+    for (function = function_list; function != NULL; function = function->next) {
+        if (strcmp(function->name, name) == 0) {
+            return function;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Function that defines a shell function or replaces the body of an existing one
+*/
+void define_function(char* name, struct program* body) {
+    struct function* function = find_function(name);
+    body->references++;
+    if (function != NULL) {
+        release_program(function->program);
+    }
+    else {
+        function = malloc(sizeof(struct function));
+        function->name = strdup(name);
+        function->next = function_list;
+        function_list = function;
+    }
+    function->program = body;
+}
+
+void execute_command(struct command* command);
+
+/*
+    Function that runs a compiled program. Commands are rebuilt from their lexed form and only
+    expanded, so the lines of a loop body are never parsed again
+*/
+void run_program(struct program* program) {
+    struct arena_mark start = arena_save(), mark;
+    struct loop_frame *frame = NULL, *new_frame;
+    struct command command;
+    int* code = program->code;
+    int pc = 0;
+    int i;
+
+    program->references++;
+    while (pc < program->length) {
+        switch (code[pc]) {
+            case OP_RUN:
+                mark = arena_save();
+                restore_command(program->commands[code[pc + 1]], &command);
+                expand_command(&command);
+                execute_command(&command);
+                close_substitutions(command.substitution_first);
+                arena_release(mark);
+                pc += 2;
+                // A command interrupted from the keyboard ends the whole program
+                if (WIFSIGNALED(child_exit_status) && WTERMSIG(child_exit_status) == SIGINT) {
+                    pc = program->length;
+                }
+                break;
+            case OP_JUMP:
+                pc = code[pc + 1];
+                break;
+            case OP_JUMP_IF_FAILED:
+                pc = child_exit_status == 0 ? pc + 2 : code[pc + 1];
+                break;
+            case OP_FOR_START:
+                // The expanded words are copied out of the command, whose arrays are reused
+                mark = arena_save();
+                restore_command(program->commands[code[pc + 1]], &command);
+                expand_command(&command);
+                close_substitutions(command.substitution_first);
+                for (i = 0; command.stages[0].argv[i] != NULL; i++);
+                new_frame = arena_alloc(sizeof(struct loop_frame));
+                new_frame->words = arena_alloc((i + 1) * sizeof(char*));
+                memcpy(new_frame->words, command.stages[0].argv, (i + 1) * sizeof(char*));
+                new_frame->next_word = 0;
+                new_frame->mark = mark;
+                new_frame->outer = frame;
+                frame = new_frame;
+                pc += 2;
+                break;
+            case OP_FOR_NEXT:
+                if (frame->words[frame->next_word] != NULL) {
+                    setenv(program->names[code[pc + 1]], frame->words[frame->next_word++], 1);
+                    pc += 3;
+                    break;
+                }
+                // Out of words, the loop's frame is dropped as with OP_FOR_END
+                pc = code[pc + 2];
+                mark = frame->mark;
+                frame = frame->outer;
+                arena_release(mark);
+                break;
+            case OP_FOR_END:
+                mark = frame->mark;
+                frame = frame->outer;
+                arena_release(mark);
+                pc++;
+                break;
+            case OP_DEFINE:
+                define_function(program->names[code[pc + 1]], program->functions[code[pc + 2]]);
+                pc += 3;
+                break;
+            case OP_RETURN:
+                restore_command(program->commands[code[pc + 1]], &command);
+                expand_command(&command);
+                close_substitutions(command.substitution_first);
+                if (command.stages[0].argv[0] != NULL) {
+                    child_exit_status = (atoi(command.stages[0].argv[0]) & 255) << 8;
+                }
+                pc = program->length;
+                break;
+        }
+    }
+    arena_release(start);
+    release_program(program);
+}
+
+/*
+    Function that calls a shell function. The arguments become its positional arguments while it
+    runs, and $0 stays the same
+*/
+void call_function(struct function* function, char** argv) {
+    static int depth = 0;
+    char** saved_arguments = arguments;
+    int saved_count = argument_count;
+
+    if (depth == MAX_FUNCTION_DEPTH) {
+        printf("%s: maximum function nesting level exceeded\n", argv[0]);
+        fflush(stdout);
+        return;
+    }
+    argv[0] = arguments[0];
+    arguments = argv;
+    for (argument_count = 0; argv[argument_count + 1] != NULL; argument_count++);
+    depth++;
+    run_program(function->program);
+    depth--;
+    arguments = saved_arguments;
+    argument_count = saved_count;
+}
+
+/*
+    Function that runs a parsed and expanded command line. The 'time' keyword and the @name=value
+    job settings in front of it are taken off, then it is run as a builtin, a shell function or a
+    pipeline of other commands
+*/
+void execute_command(struct command* command) {
+    struct stage* stages = command->stages;
+    int stage_count = command->stage_count;
+    struct function* function;
+    struct job_options options;
+    struct rusage self_before, children_before;
+    struct timespec start;
+    char** argv;
+    int timed;
+
+    // The 'time' keyword in front of a command asks for its resource usage
+    timed = 0;
+    if (strcmp(stages[0].argv[0], "time") == 0) {
+        stages[0].argv++;
+        timed = 1;
+        if (stages[0].argv[0] == NULL) {
+            printf("time: usage: time command\n");
+            fflush(stdout);
+            return;
+        }
+    }
+
+    // Per-job settings are given as @name=value words in front of the command
+    memset(&options, 0, sizeof(options));
+    options.node = -1;
+    while (stages[0].argv[0] != NULL && stages[0].argv[0][0] == '@' && strchr(stages[0].argv[0], '=') != NULL) {
+        if (set_job_option(&options, stages[0].argv[0]) == -1) {
+            printf("%s: unknown job setting\n", stages[0].argv[0]);
+            fflush(stdout);
+            break;
+        }
+        stages[0].argv++;
+    }
+    if (stages[0].argv[0] == NULL || stages[0].argv[0][0] == '@') {
+        return;
+    }
+    if (cgroup_root == NULL && (options.memory_max != NULL || options.cpu_max != NULL || options.io_max != NULL)) {
+        printf("cgroup limits need cgroup mode, see 'cgroup on'\n");
+        fflush(stdout);
+        return;
+    }
+    argv = stages[0].argv;
+
+    // A timed pipeline is measured by run_pipeline. Anything else runs in the shell, which takes
+    // its usage before and after
+    if (timed) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        getrusage(RUSAGE_SELF, &self_before);
+        getrusage(RUSAGE_CHILDREN, &children_before);
+    }
+
+    // Builtins are only recognized when they are not part of a pipeline
+    // See if user has entered the 'exit' command
+    if (stage_count == 1 && strcmp(argv[0], "exit") == 0) {
+        exit(0);
+    }
+    // See if user has entered the 'cd' command
+    else if (stage_count == 1 && strcmp(argv[0], "cd") == 0) {
+        // If no directory specifed, go to home directory
+        if (argv[1] == NULL) {
+            chdir_shell(getenv("HOME"));
+        }
+        // If a directory is specified, go there
+        else {
+            chdir_shell(argv[1]);
+        }
+    }
+    // See if user has entered the 'status' command
+    else if (stage_count == 1 && strcmp(argv[0], "status") == 0) {
+        // If the process exited normally the exit status is displayed
+        if (WIFEXITED(child_exit_status)) {
+            printf("exit value %i\n", WEXITSTATUS(child_exit_status));
+        }
+        // If the process was terminated by a signal, termination signal is displayed
+        else {
+            printf("terminated by signal %i\n", child_exit_status);
+        }
+        fflush(stdout);
+    }
+    // See if user has entered the 'hash' command
+    else if (stage_count == 1 && strcmp(argv[0], "hash") == 0) {
+        hash_builtin(argv);
+    }
+    // See if user has entered the 'pipesize' command
+    else if (stage_count == 1 && strcmp(argv[0], "pipesize") == 0) {
+        pipesize_builtin(argv);
+    }
+    // See if user has entered the 'parallel' command. In the background it runs in a subshell,
+    // which cannot share the shell's stdin, so its input has to be redirected
+    else if (stage_count == 1 && strcmp(argv[0], "parallel") == 0) {
+        if (command->background_mode_flag == 1 && foreground_mode_flag == 0) {
+            parallel_background(command);
+        }
+        else {
+            child_exit_status = parallel_builtin(&stages[0]) << 8;
+        }
+    }
+    // See if user has entered the 'cgroup' command
+    else if (stage_count == 1 && strcmp(argv[0], "cgroup") == 0) {
+        cgroup_builtin(argv);
+    }
+    // See if user has entered the 'placement' command
+    else if (stage_count == 1 && strcmp(argv[0], "placement") == 0) {
+        placement_builtin(argv);
+    }
+    // Shell functions run in the shell itself, so they cannot be part of a pipeline either
+    else if (stage_count == 1 && (function = find_function(argv[0])) != NULL) {
+        call_function(function, argv);
+    }
+    // Plain 'cat' and 'cp' in the foreground copy the data in the shell without starting a child.
+    // Timed jobs, jobs in cgroup mode and placed jobs still run the programs, to be measured,
+    // limited and placed
+    else if (stage_count == 1 && (strcmp(argv[0], "cat") == 0 || strcmp(argv[0], "cp") == 0) && !timed &&
+             cgroup_root == NULL && options.cpus == NULL && options.node == -1 &&
+             (command->background_mode_flag == 0 || foreground_mode_flag == 1) &&
+             copy_builtin_applies(&stages[0])) {
+        child_exit_status = copy_builtin(&stages[0]);
+    }
+    // All other commands that require children to be spawned are now handled
+    else {
+        run_pipeline(stages, stage_count, command->background_mode_flag, timed, &options);
+        return;
+    }
+    if (timed) {
+        print_shell_usage(&self_before, &children_before, &start);
+    }
+}
+
+/*
+    Function that tells which script keyword a parsed line starts with, if any. Keywords are only
+    recognized as the first word of a line without a pipeline, and "name()" defines a function
+*/
+int line_keyword(struct command* command) {
+    char* word = command->stages[0].argv[0];
+    size_t length;
+    int i;
+    if (command->stage_count != 1 || word == NULL) {
+        return KEYWORD_NONE;
+    }
+    for (i = 1; i < KEYWORD_FUNCTION; i++) {
+        if (strcmp(word, script_keywords[i]) == 0) {
+            return i;
+        }
+    }
+    length = strlen(word);
+    if (length > 2 && strcmp(word + length - 2, "()") == 0) {
+        return KEYWORD_FUNCTION;
+    }
+    return KEYWORD_NONE;
+}
+
+/*
+    Function that reports a line the script parser did not expect
+*/
+void syntax_error(struct command* command) {
+    printf("syntax error near %s\n", command->stages[0].argv[0] != NULL ? command->stages[0].argv[0] : "newline");
+    fflush(stdout);
+}
+
+/*
+    Function that checks whether a keyword stands alone on its line
+*/
+int bare_keyword(struct command* command) {
+    return command->stages[0].argv[1] == NULL && command->stages[0].redirection_count == 0 &&
+           !command->background_mode_flag;
+}
+
+/*
+    Function that checks whether a word is a valid variable or function name
+*/
+int valid_name(char* name) {
+    if (!((*name >= 'a' && *name <= 'z') || (*name >= 'A' && *name <= 'Z') || *name == '_')) {
+        return 0;
+    }
+    while ((*name >= 'a' && *name <= 'z') || (*name >= 'A' && *name <= 'Z') || (*name >= '0' && *name <= '9') || *name == '_') {
+        name++;
+    }
+    return *name == '\0';
+}
+
+/*
+    Function that reads the next line of a compound command that is not blank or a comment and
+    parses it into command. Returns -1 at a syntax error or the end of the input
+*/
+int read_script_line(struct command* command) {
+    char* line;
+    int result;
+    do {
+        line = read_command_line(1);
+        if (line == NULL) {
+            printf("syntax error: unexpected end of input\n");
+            fflush(stdout);
+            return -1;
+        }
+        result = parse_command_line(line, command);
+    } while (result == 0);
+    return result;
+}
+
+/*
+    Function that checks that a list ended with the expected keyword, alone on its line. Returns -1
+    after reporting a syntax error if it did not
+*/
+int expect_keyword(struct command* command, int keyword, int expected) {
+    if (keyword != expected || !bare_keyword(command)) {
+        syntax_error(command);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Function that allocates a syntax tree node in the arena
+*/
+struct node* new_node(int type) {
+    struct node* node = arena_alloc(sizeof(struct node));
+    memset(node, 0, sizeof(struct node));
+    node->type = type;
+    return node;
+}
+
+/*
+    Function that saves a keyword line for the compiled program, leaving out its first skip words
+*/
+struct cached_command* save_keyword_line(struct command* command, int skip) {
+    command->stages[0].argv += skip;
+    return save_command(NULL, 0, command);
+}
+
+/*
+    Function that frees the commands of a syntax tree that were not handed to a compiled program.
+    The nodes themselves are in the arena
+*/
+void free_tree(struct node* node) {
+    for (; node != NULL; node = node->next) {
+        free(node->command);
+        free_tree(node->body);
+        free_tree(node->alternative);
+    }
+}
+
+int parse_compound(struct command* command, int keyword, int loops, struct node** node);
+
+/*
+    Function that parses lines into a list of nodes until a line starts with a keyword that ends a
+    list, which is returned in terminator with the line left in command. loops is the number of
+    loops around the list, for break and continue. Returns -1 at a syntax error
+*/
+int parse_list(struct command* command, int loops, struct node** list, int* terminator) {
+    struct node** tail = list;
+    int keyword;
+
+    while (1) {
+        if (read_script_line(command) == -1) {
+            return -1;
+        }
+        keyword = line_keyword(command);
+        switch (keyword) {
+            case KEYWORD_IF:
+            case KEYWORD_WHILE:
+            case KEYWORD_FOR:
+            case KEYWORD_FUNCTION:
+                if (parse_compound(command, keyword, loops, tail) == -1) {
+                    return -1;
+                }
+                break;
+            case KEYWORD_BREAK:
+            case KEYWORD_CONTINUE:
+                if (loops == 0 || !bare_keyword(command)) {
+                    syntax_error(command);
+                    return -1;
+                }
+                *tail = new_node(keyword == KEYWORD_BREAK ? NODE_BREAK : NODE_CONTINUE);
+                break;
+            case KEYWORD_RETURN:
+                *tail = new_node(NODE_RETURN);
+                (*tail)->command = save_keyword_line(command, 1);
+                break;
+            case KEYWORD_NONE:
+                *tail = new_node(NODE_COMMAND);
+                (*tail)->command = save_command(NULL, 0, command);
+                break;
+            default:
+                *terminator = keyword;
+                return 0;
+        }
+        tail = &(*tail)->next;
+    }
+}
+
+/*
+    Function that parses an if, while or for command or a function definition whose first line is
+    in command, reading the rest of its lines. The node is stored in node as soon as it is made, so
+    that free_tree finds everything after a syntax error. Returns -1 at a syntax error
+*/
+int parse_compound(struct command* command, int keyword, int loops, struct node** node) {
+    struct node* compound = new_node(NODE_IF);
+    char** argv = command->stages[0].argv;
+    int terminator;
+
+    *node = compound;
+    switch (keyword) {
+        case KEYWORD_IF:
+        case KEYWORD_ELIF:
+            // if COMMAND, then, a list, then elif (which is parsed as a nested if), else or fi
+            if (argv[1] == NULL) {
+                syntax_error(command);
+                return -1;
+            }
+            compound->command = save_keyword_line(command, 1);
+            if (read_script_line(command) == -1 || expect_keyword(command, line_keyword(command), KEYWORD_THEN) == -1 ||
+                parse_list(command, loops, &compound->body, &terminator) == -1) {
+                return -1;
+            }
+            if (terminator == KEYWORD_ELIF) {
+                return parse_compound(command, KEYWORD_ELIF, loops, &compound->alternative);
+            }
+            if (terminator == KEYWORD_ELSE) {
+                if (!bare_keyword(command) || parse_list(command, loops, &compound->alternative, &terminator) == -1) {
+                    syntax_error(command);
+                    return -1;
+                }
+            }
+            return expect_keyword(command, terminator, KEYWORD_FI);
+        case KEYWORD_WHILE:
+            // while COMMAND, do, a list and done
+            if (argv[1] == NULL) {
+                syntax_error(command);
+                return -1;
+            }
+            compound->type = NODE_WHILE;
+            compound->command = save_keyword_line(command, 1);
+            if (read_script_line(command) == -1 || expect_keyword(command, line_keyword(command), KEYWORD_DO) == -1 ||
+                parse_list(command, loops + 1, &compound->body, &terminator) == -1) {
+                return -1;
+            }
+            return expect_keyword(command, terminator, KEYWORD_DONE);
+        case KEYWORD_FOR:
+            // for NAME in WORDS, do, a list and done
+            if (argv[1] == NULL || !valid_name(argv[1]) || argv[2] == NULL || strcmp(argv[2], "in") != 0 ||
+                command->stages[0].redirection_count != 0) {
+                syntax_error(command);
+                return -1;
+            }
+            compound->type = NODE_FOR;
+            compound->name = strcpy(arena_alloc(strlen(argv[1]) + 1), argv[1]);
+            compound->command = save_keyword_line(command, 3);
+            if (read_script_line(command) == -1 || expect_keyword(command, line_keyword(command), KEYWORD_DO) == -1 ||
+                parse_list(command, loops + 1, &compound->body, &terminator) == -1) {
+                return -1;
+            }
+            return expect_keyword(command, terminator, KEYWORD_DONE);
+        default:
+            // NAME(), then { either on the same line or the next, a list and }
+            compound->type = NODE_FUNCTION;
+            compound->name = arena_alloc(strlen(argv[0]) - 1);
+            memcpy(compound->name, argv[0], strlen(argv[0]) - 2);
+            compound->name[strlen(argv[0]) - 2] = '\0';
+            if (!valid_name(compound->name)) {
+                syntax_error(command);
+                return -1;
+            }
+            if (argv[1] != NULL) {
+                if (strcmp(argv[1], "{") != 0 || argv[2] != NULL) {
+                    syntax_error(command);
+                    return -1;
+                }
+            }
+            else if (read_script_line(command) == -1 || expect_keyword(command, line_keyword(command), KEYWORD_OPEN_BRACE) == -1) {
+                return -1;
+            }
+            if (parse_list(command, 0, &compound->body, &terminator) == -1) {
+                return -1;
+            }
+            return expect_keyword(command, terminator, KEYWORD_CLOSE_BRACE);
+    }
+}
+
+/*
+    Function that appends a value to the code of a program and returns its position
+*/
+int emit(struct program* program, int value) {
+    program->code = grow_array(program->code, program->length, sizeof(int));
+    program->code[program->length] = value;
+    return program->length++;
+}
+
+/*
+    Function that moves the command of a node into a program and returns its index there
+*/
+int take_command(struct program* program, struct node* node) {
+    program->commands = grow_array(program->commands, program->command_count, sizeof(struct cached_command*));
+    program->commands[program->command_count] = node->command;
+    node->command = NULL;
+    return program->command_count++;
+}
+
+/*
+    Function that copies a name into a program and returns its index there
+*/
+int add_name(struct program* program, char* name) {
+    program->names = grow_array(program->names, program->name_count, sizeof(char*));
+    program->names[program->name_count] = strdup(name);
+    return program->name_count++;
+}
+
+struct program* compile_program(struct node* tree);
+
+/*
+    Function that compiles a list of nodes into a program. loop is the innermost loop around the
+    list, whose break jumps are collected to be patched once its end is known
+*/
+void compile_list(struct program* program, struct node* node, struct loop_context* loop) {
+    struct loop_context inner;
+    int jump, end, i;
+
+    for (; node != NULL; node = node->next) {
+        switch (node->type) {
+            case NODE_COMMAND:
+                emit(program, OP_RUN);
+                emit(program, take_command(program, node));
+                break;
+            case NODE_IF:
+                // The condition is run and a failure jumps over the then branch to the else branch
+                emit(program, OP_RUN);
+                emit(program, take_command(program, node));
+                jump = emit(program, OP_JUMP_IF_FAILED);
+                emit(program, 0);
+                compile_list(program, node->body, loop);
+                if (node->alternative != NULL) {
+                    end = emit(program, OP_JUMP);
+                    emit(program, 0);
+                    program->code[jump + 1] = program->length;
+                    compile_list(program, node->alternative, loop);
+                    program->code[end + 1] = program->length;
+                }
+                else {
+                    program->code[jump + 1] = program->length;
+                }
+                break;
+            case NODE_WHILE:
+                // The condition is run before every pass and a failure leaves the loop
+                inner.continue_target = program->length;
+                inner.breaks = NULL;
+                inner.break_count = 0;
+                emit(program, OP_RUN);
+                emit(program, take_command(program, node));
+                jump = emit(program, OP_JUMP_IF_FAILED);
+                emit(program, 0);
+                compile_list(program, node->body, &inner);
+                emit(program, OP_JUMP);
+                emit(program, inner.continue_target);
+                program->code[jump + 1] = program->length;
+                for (i = 0; i < inner.break_count; i++) {
+                    program->code[inner.breaks[i] + 1] = program->length;
+                }
+                free(inner.breaks);
+                break;
+            case NODE_FOR:
+                // The words are expanded once, then each pass takes the next one. A break has to
+                // drop the loop frame, which the loop does itself when it runs out of words
+                emit(program, OP_FOR_START);
+                emit(program, take_command(program, node));
+                inner.continue_target = program->length;
+                inner.breaks = NULL;
+                inner.break_count = 0;
+                emit(program, OP_FOR_NEXT);
+                emit(program, add_name(program, node->name));
+                emit(program, 0);
+                compile_list(program, node->body, &inner);
+                emit(program, OP_JUMP);
+                emit(program, inner.continue_target);
+                for (i = 0; i < inner.break_count; i++) {
+                    program->code[inner.breaks[i] + 1] = program->length;
+                }
+                emit(program, OP_FOR_END);
+                program->code[inner.continue_target + 2] = program->length;
+                free(inner.breaks);
+                break;
+            case NODE_FUNCTION:
+                // The body becomes a program of its own, defined each time this is run
+                emit(program, OP_DEFINE);
+                emit(program, add_name(program, node->name));
+                program->functions = grow_array(program->functions, program->function_count, sizeof(struct program*));
+                program->functions[program->function_count] = compile_program(node->body);
+                emit(program, program->function_count++);
+                break;
+            case NODE_BREAK:
+                loop->breaks = grow_array(loop->breaks, loop->break_count, sizeof(int));
+                loop->breaks[loop->break_count++] = emit(program, OP_JUMP);
+                emit(program, 0);
+                break;
+            case NODE_CONTINUE:
+                emit(program, OP_JUMP);
+                emit(program, loop->continue_target);
+                break;
+            case NODE_RETURN:
+                emit(program, OP_RETURN);
+                emit(program, take_command(program, node));
+                break;
+        }
+    }
+}
+
+/*
+    Function that compiles a syntax tree into a new program, owned by the caller
+*/
+struct program* compile_program(struct node* tree) {
+    struct program* program = calloc(1, sizeof(struct program));
+    if (program == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    program->references = 1;
+    compile_list(program, tree, NULL);
+    return program;
+}
+
+/*
+    Function that parses a compound command starting with the line in command, compiles it and runs it
+*/
+void run_compound(struct command* command, int keyword) {
+    struct node* tree = NULL;
+    struct program* program;
+    if (parse_compound(command, keyword, 0, &tree) == -1) {
+        free_tree(tree);
+        return;
+    }
+    program = compile_program(tree);
+    run_program(program);
+    release_program(program);
+}
+
+/*
+* This is main function that runs the shell. 'smallsh SCRIPT [ARGS]' runs the commands in a file
+* and 'smallsh -c COMMANDS [NAME [ARGS]]' the ones given, with the positional arguments set from
+* the rest of the command line. Without either, commands are read from stdin
+*/
+int main(int argc, char* argv[])
+{
+    // Variables and structs are initialized
+    char* user_input;
+    struct command command;
+    int keyword;
+
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc == 2) {
+            printf("smallsh: -c: option requires an argument\n");
+            return 2;
+        }
+        script_next = argv[2];
+        script_end = argv[2] + strlen(argv[2]);
+        script_terminated = 1;
+        if (argc > 3) {
+            arguments = &argv[3];
+            argument_count = argc - 4;
+        }
+    }
+    else if (argc > 1) {
+        if (map_script(argv[1]) == -1) {
+            printf("%s: no such file or directory\n", argv[1]);
+            return 127;
+        }
+        arguments = &argv[1];
+        argument_count = argc - 2;
+    }
+    interactive = script_next == NULL && isatty(STDIN_FILENO);
+    init_input();
+    chdir_shell(".");
+
+    // The event loop watching stdin, the signals and the background jobs is created
+    init_event_loop();
+    init_scanner();
+    pid_length = sprintf(pid_string, "%d", getpid());
+
+    // The shell then starts and runs until the 'exit' command is given and exit(0) is executed
+    while (1) {
+        // Memory used by the last command line is reclaimed
+        arena_reset();
+
+        // Background jobs that finished and signals that arrived while the last command ran are handled
+        run_event_loop(EVENTS_PENDING);
+
+        // The command prompt is displayed and the user's command is collected. At the end of its
+        // input the shell exits, a script with the exit value of its last command
+        user_input = read_command_line(0);
+        if (user_input == NULL) {
+            exit(script_next != NULL ? last_exit_value() : 0);
+        }
+
+        // Parse the user-entered command. Blank lines, comments and syntax errors show a new prompt
+        if (parse_command_line(user_input, &command) == 1) {
+            keyword = line_keyword(&command);
+            // if, while, for and function definitions read the rest of their lines and are compiled
+            if (keyword == KEYWORD_IF || keyword == KEYWORD_WHILE || keyword == KEYWORD_FOR || keyword == KEYWORD_FUNCTION) {
+                run_compound(&command, keyword);
+            }
+            // Any other keyword is out of place here
+            else if (keyword != KEYWORD_NONE) {
+                syntax_error(&command);
+            }
+            else {
+                expand_command(&command);
+                execute_command(&command);
+                close_substitutions(command.substitution_first);
+            }
+        }
+    }
+    // The program ends
+	return 0;
+}